@@ -0,0 +1,230 @@
+/*
+ * With --cache=DIR, the blobs made from each ,v file are kept in DIR
+ * for the next run, in one file per ,v file named by the SHA-1 of its
+ * path and headed by the size and modification time the ,v file had.
+ * When a later run finds the ,v file unchanged, its blobs go to
+ * export_blob again straight from the cache, in the order they were
+ * made, with no edits applied and no keywords expanded.  Threads may
+ * have made them out of turn; any marks generate_files would have
+ * reserved up front are reserved the same way before they go out.  With --pack
+ * the cache keeps only the name of each blob, and is used only while
+ * the repository still has every one of them.
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include "cvs.h"
+
+#define CACHE_VERSION	1
+
+static FILE *cache_out;
+static char cache_name[PATH_MAX], cache_tmp[PATH_MAX + 8];
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+compare_nodes (const void *a, const void *b)
+{
+    return cvs_number_compare (&(*(Node * const *) a)->number,
+			       &(*(Node * const *) b)->number);
+}
+
+/* What the cache of CVS must start with to be used, or -1 */
+static int
+cache_header (cvs_file *cvs, char *header, size_t size)
+{
+    struct stat	st;
+    int		n;
+
+    if (stat (cvs->name, &st) < 0)
+	return -1;
+    n = snprintf (header, size, "parsecvs-cache %d %c %d\n%s\n%lld %lld %ld\n",
+		  CACHE_VERSION, pack_repo ? 's' : 'd',
+		  suppress_keyword_expansion, cvs->name,
+		  (long long) st.st_size, (long long) st.st_mtim.tv_sec,
+		  (long) st.st_mtim.tv_nsec);
+    return n < (int) size ? n : -1;
+}
+
+/*
+ * Go through the entries of the cache F, which must name each
+ * revision of CVS that has a blob exactly once.  Only when EMIT are
+ * the blobs handed out; before that, check the whole file, so that
+ * a bad cache is found before any blob has gone out.
+ */
+static bool
+cache_read (cvs_file *cvs, FILE *f, off_t size, bool emit)
+{
+    cvs_version	    *v;
+    Node	    **nodes, **found, probe, *key = &probe;
+    char	    line[CVS_MAX_REV_LEN + 64], rev[CVS_MAX_REV_LEN + 1];
+    char	    hex[41], *buf = NULL, *s;
+    bool	    *seen, ok = false;
+    int		    n = 0, used = 0, i;
+    unsigned long   len;
+    size_t	    bufmax = 0;
+    unsigned char   sha1[20];
+    struct iovec    iov;
+
+    for (v = cvs->versions; v; v = v->next)
+	n++;
+    nodes = xmalloc ((n + 1) * sizeof (Node *));
+    seen = xmalloc (n + 1);
+    memset (seen, 0, n + 1);
+    n = 0;
+    for (v = cvs->versions; v; v = v->next)
+	if (v->node && v->node->file)
+	    nodes[n++] = v->node;
+    qsort (nodes, n, sizeof (Node *), compare_nodes);
+
+    while (fgets (line, sizeof (line), f)) {
+	if (!strchr (line, '\n'))
+	    goto done;
+	/* the rev must fit in a cvs_number */
+	for (i = 0, s = line; *s && *s != ' '; s++)
+	    if (*s == '.')
+		i++;
+	if (i >= CVS_MAX_DEPTH || s - line > CVS_MAX_REV_LEN)
+	    goto done;
+	memcpy (rev, line, s - line);
+	rev[s - line] = '\0';
+	probe.number = lex_number (rev);
+	found = bsearch (&key, nodes, n, sizeof (Node *), compare_nodes);
+	if (!found || seen[found - nodes])
+	    goto done;
+	seen[found - nodes] = true;
+	used++;
+	if (pack_repo) {
+	    if (sscanf (s, " %40[0-9a-f]", hex) != 1 || strlen (hex) != 40)
+		goto done;
+	    for (i = 0; i < 20; i++)
+		sscanf (hex + 2 * i, "%2hhx", &sha1[i]);
+	    if (emit)
+		export_blob_known (*found, sha1);
+	    else if (!pack_has_object (sha1))
+		goto done;
+	    continue;
+	}
+	if (sscanf (s, " %lu", &len) != 1 || len > (unsigned long) size)
+	    goto done;
+	if (!emit) {
+	    if (fseeko (f, len, SEEK_CUR) < 0 || ftello (f) > size)
+		goto done;
+	    continue;
+	}
+	if (len > bufmax) {
+	    bufmax = len;
+	    buf = xrealloc (buf, bufmax);
+	}
+	if (len && fread (buf, 1, len, f) != len)
+	    goto done;
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	export_blob (*found, &iov, 1, len);
+    }
+    ok = !ferror (f) && used == n;
+done:
+    free (buf);
+    free (seen);
+    free (nodes);
+    return ok;
+}
+
+/* Hand out the blobs of CVS from its cache, if the cache will do */
+static bool
+cache_replay (cvs_file *cvs, char *header, int hlen)
+{
+    FILE	*f = fopen (cache_name, "r");
+    char	*have;
+    off_t	start;
+    struct stat	st;
+    bool	ok = false;
+
+    if (!f)
+	return false;
+    have = xmalloc (hlen);
+    if (fstat (fileno (f), &st) == 0 &&
+	fread (have, 1, hlen, f) == (size_t) hlen &&
+	memcmp (have, header, hlen) == 0 &&
+	(start = ftello (f)) >= 0 &&
+	cache_read (cvs, f, st.st_size, false) &&
+	fseeko (f, start, SEEK_SET) == 0) {
+	generate_reserve_marks (cvs);
+	ok = cache_read (cvs, f, st.st_size, true);
+    }
+    free (have);
+    fclose (f);
+    return ok;
+}
+
+/*
+ * export_blob, keeping the blob, or with --pack its name, in the
+ * cache.  The blob is kept first, since writing it to the stream may
+ * leave IOV pointing past what a short write took.
+ */
+static void
+cache_hook (Node *node, struct iovec *iov, int iovcnt, unsigned long len)
+{
+    char	    rev[CVS_MAX_REV_LEN + 1];
+    unsigned char   sha1[20];
+    int		    i;
+
+    if (!pack_repo) {
+	pthread_mutex_lock (&cache_lock);
+	fprintf (cache_out, "%s %lu\n",
+		 cvs_number_string (&node->number, rev), len);
+	for (i = 0; i < iovcnt; i++)
+	    fwrite (iov[i].iov_base, 1, iov[i].iov_len, cache_out);
+	pthread_mutex_unlock (&cache_lock);
+	export_blob (node, iov, iovcnt, len);
+	return;
+    }
+    export_blob (node, iov, iovcnt, len);
+    export_blob_sha (node, sha1);
+    pthread_mutex_lock (&cache_lock);
+    fputs (cvs_number_string (&node->number, rev), cache_out);
+    putc (' ', cache_out);
+    for (i = 0; i < 20; i++)
+	fprintf (cache_out, "%02x", sha1[i]);
+    putc ('\n', cache_out);
+    pthread_mutex_unlock (&cache_lock);
+}
+
+void
+cache_generate (cvs_file *cvs)
+{
+    char	    header[PATH_MAX + 128], hex[41];
+    unsigned char   sha1[20];
+    sha1_ctx	    ctx;
+    int		    hlen, fd, i;
+
+    /* annotations are made along with the blobs */
+    if (annotate_file || (hlen = cache_header (cvs, header, sizeof (header))) < 0) {
+	generate_files (cvs, export_blob);
+	return;
+    }
+    sha1_init (&ctx);
+    sha1_update (&ctx, cvs->name, strlen (cvs->name));
+    sha1_final (&ctx, sha1);
+    for (i = 0; i < 20; i++)
+	sprintf (hex + 2 * i, "%02x", sha1[i]);
+    snprintf (cache_name, sizeof (cache_name), "%s/%s", cache_dir, hex);
+    if (cache_replay (cvs, header, hlen))
+	return;
+
+    snprintf (cache_tmp, sizeof (cache_tmp), "%s.XXXXXX", cache_name);
+    if ((fd = mkstemp (cache_tmp)) < 0 || !(cache_out = fdopen (fd, "w"))) {
+	fprintf (stderr, "parsecvs: creating %s: %s\n", cache_tmp, strerror (errno));
+	if (fd >= 0)
+	    close (fd);
+	generate_files (cvs, export_blob);
+	return;
+    }
+    fwrite (header, 1, hlen, cache_out);
+    generate_files (cvs, cache_hook);
+    if (ferror (cache_out) | (fclose (cache_out) == EOF) ||
+	rename (cache_tmp, cache_name) < 0) {
+	fprintf (stderr, "parsecvs: writing %s: %s\n", cache_tmp, strerror (errno));
+	unlink (cache_tmp);
+    }
+    cache_out = NULL;
+}
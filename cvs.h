@@ -31,6 +31,7 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <stdbool.h>
 
@@ -61,6 +62,10 @@ typedef struct node {
 	struct node *sib;
 	struct _rev_file *file;
 	int starts;
+	char *blob;		/* text of file, waiting for its turn */
+	unsigned long bloblen;
+	bool blobready;
+	off_t textoff;		/* the blob lies verbatim in the ,v file here */
 } Node;
 
 typedef struct _cvs_symbol {
@@ -88,11 +93,19 @@ typedef struct _cvs_version {
     Node		*node;
 } cvs_version;
 
+typedef struct _cvs_text {
+    char		*data;
+    size_t		length;	/* bytes in data, both @ delimiters included */
+    off_t		offset;	/* of the data in the ,v file, 0 if it had @@ */
+} cvs_text;
+
 typedef struct _cvs_patch {
     struct _cvs_patch	*next;
     cvs_number		number;
     char		*log;
     char		*text;
+    size_t		textlen;
+    off_t		textoff;	/* as in cvs_text */
     Node		*node;
 } cvs_patch;
 
@@ -107,15 +120,21 @@ typedef struct {
     mode_t		mode;
     int			nversions;
     char 		*expand;
+    int			id, dir;	/* as in rev_file */
 } cvs_file;
 
 typedef struct _rev_file {
     char		*name;
+    int			id;		/* of the ,v file, in name order */
+    int			dir;		/* shared by neighbours in one directory */
     cvs_number		number;
     time_t		date;
     int                 mark;
     mode_t		mode;
     struct _rev_file	*link;
+    long		lines;		/* set by generate_diffstat */
+    long		added, removed;
+    bool		used;		/* by an exported commit */
 } rev_file;
 
 typedef struct _rev_dir {
@@ -133,10 +152,38 @@ extern int load_current_file, load_total_files;
 
 extern FILE *revision_map;
 
+extern FILE *annotate_file;
+
 extern bool reposurgeon;
 
 extern bool suppress_keyword_expansion;
 
+typedef enum _line_store_mode {
+    LineStoreMerge, LineStoreGap, LineStoreRope
+} line_store_mode;
+
+extern line_store_mode line_store;
+
+extern int threads;
+
+extern bool dedup_blobs;
+
+extern char *blob_output, *commit_output;
+
+extern bool blob_shards;
+
+extern bool writer_thread;
+
+extern bool compress_output;
+
+extern bool inline_blobs;
+
+extern char *pack_repo;
+
+extern char *cache_dir;
+
+extern bool late_blobs;
+
 typedef struct _rev_commit {
     struct _rev_commit	*parent;
     char		tail;
@@ -242,11 +289,14 @@ typedef struct _tag {
 	rev_commit *commit;
 	rev_ref *parent;
 	char *last;
+	struct _tag *commit_next;	/* next tag on commit */
 } Tag;
 
 extern Tag *all_tags;
 void tag_commit(rev_commit *c, char *name);
 rev_commit **tagged(Tag *tag);
+void index_tags(void);
+Tag *commit_tags(rev_commit *c);
 void discard_tags(void);
 
 int
@@ -360,7 +410,7 @@ rev_ref *
 rev_branch_of_commit (rev_list *rl, rev_commit *commit);
 
 rev_file *
-rev_file_rev (char *name, cvs_number *n, time_t date);
+rev_file_rev (cvs_file *cvs, cvs_number *n, time_t date);
 
 void
 rev_file_free (rev_file *f);
@@ -383,18 +433,93 @@ rev_list_validate (rev_list *rl);
 #define time_compare(a,b) ((long) (a) - (long) (b))
 
 void 
-export_blob(Node *node, void *buf, unsigned long len);
+export_blob(Node *node, struct iovec *iov, int iovcnt, unsigned long len);
+
+void
+export_blob_known (Node *node, unsigned char *sha1);
+
+void
+export_blob_sha (Node *node, unsigned char *sha1);
+
+void
+cache_generate (cvs_file *cvs);
+
+void
+export_dedup_report (void);
+
+void
+export_close (void);
+
+typedef struct _out_stream out_stream;
+
+out_stream *
+stream_fd (int fd, char *name, bool gzip);
+
+out_stream *
+stream_open (char *name, bool gzip);
+
+void
+stream_write (out_stream *s, const void *p, size_t n);
+
+void
+stream_writev (out_stream *s, struct iovec *iov, int iovcnt, size_t len);
+
+void
+stream_sendfile (out_stream *s, int fd, off_t offset,
+		 struct iovec *iov, int iovcnt, size_t len);
+
+void
+stream_puts (out_stream *s, const char *str);
+
+void
+stream_putc (out_stream *s, int c);
+
+void
+stream_uint (out_stream *s, unsigned long v);
+
+void
+stream_octal (out_stream *s, unsigned long v);
+
+void
+stream_flush (out_stream *s);
+
+void
+stream_close (out_stream *s);
+
+void
+export_reserve_marks (Node **nodes, int n);
+
+int generate_slot(void);
 
 void
 export_init(void);
 
+void
+export_used_files (rev_list *rl);
+
 bool
 export_commits (rev_list *rl, int strip);
 
 void
 free_author_map (void);
 
-void generate_files(cvs_file *cvs, void (*hook)(Node *node, void *buf, unsigned long len));
+void generate_files(cvs_file *cvs, void (*hook)(Node *node, struct iovec *iov, int iovcnt, unsigned long len));
+void generate_reserve_marks(cvs_file *cvs);
+
+char *generate_revision(cvs_file *cvs, cvs_number *number, unsigned long *len);
+
+char *generate_delta(Node **base, unsigned long *len);
+
+void generate_diffstat(cvs_file *cvs);
+
+void
+diffstat_commits (rev_list *rl, int strip);
+
+void
+export_name_file (int id, char *file, int strip);
+
+char *
+export_filename (rev_file *file, int strip);
 
 rev_dir **
 rev_pack_files (rev_file **files, int nfiles, int *ndr);
@@ -417,6 +542,48 @@ xmalloc(size_t size);
 void* 
 xrealloc(void *ptr, size_t size);
 
+typedef struct _sha1_ctx {
+    uint32_t		h[5];
+    uint64_t		len;
+    unsigned char	buf[64];
+} sha1_ctx;
+
+void
+sha1_init (sha1_ctx *ctx);
+
+void
+sha1_update (sha1_ctx *ctx, const void *data, size_t len);
+
+void
+sha1_final (sha1_ctx *ctx, unsigned char *digest);
+
+void
+sha1_object (const char *type, struct iovec *iov, int iovcnt,
+	     unsigned long len, unsigned char *digest);
+
+enum { OBJ_COMMIT = 1, OBJ_TREE = 2, OBJ_BLOB = 3, OBJ_OFS_DELTA = 6 };
+
+void
+pack_open (char *repo);
+
+void
+pack_object (int type, struct iovec *iov, int iovcnt, unsigned long len,
+	     unsigned char *sha1);
+
+void
+pack_delta (struct iovec *iov, int iovcnt, unsigned long len,
+	    unsigned char *base, char *delta, unsigned long deltalen,
+	    unsigned char *sha1);
+
+bool
+pack_has_object (unsigned char *sha1);
+
+void
+pack_ref (char *name, unsigned char *sha1);
+
+void
+pack_close (void);
+
 void hash_version(cvs_version *);
 void hash_patch(cvs_patch *);
 void hash_branch(cvs_branch *);
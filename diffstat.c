@@ -0,0 +1,117 @@
+/*
+ * Report the lines added and removed by each commit, from the line
+ * counts generate_diffstat() read off the delta scripts.
+ */
+
+#include "cvs.h"
+
+static long total_added, total_removed;
+static int total_commits;
+static rev_commit **chain;
+static int chainmax;
+
+/*
+ * Move FL on to the first file numbered ID or above, and say whether
+ * it is ID.  The lists of a rev_diff run in file id order, so one
+ * pointer walked along with the other list finds every match.
+ */
+static bool
+diffstat_has (rev_file_list **fl, int id)
+{
+    while (*fl && (*fl)->file->id < id)
+	*fl = (*fl)->next;
+    return *fl && (*fl)->file->id == id;
+}
+
+static void
+diffstat_commit (rev_commit *commit, char *branch, int strip)
+{
+    rev_diff	    *diff = rev_commit_diff (commit->parent, commit);
+    rev_file_list   *fl, *other;
+    rev_file	    *f;
+    long	    added = 0, removed = 0;
+    int		    nfiles = 0;
+    char	    date[32], rev[CVS_MAX_REV_LEN];
+
+    /* a file in both lists changed; in only one, it came or went */
+    for (fl = diff->add, other = diff->del; fl; fl = fl->next, nfiles++) {
+	f = fl->file;
+	if (diffstat_has (&other, f->id)) {
+	    added += f->added;
+	    removed += f->removed;
+	} else
+	    added += f->lines;
+    }
+    for (fl = diff->del, other = diff->add; fl; fl = fl->next)
+	if (!diffstat_has (&other, fl->file->id)) {
+	    removed += fl->file->lines;
+	    nfiles++;
+	}
+
+    strftime (date, sizeof (date), "%Y-%m-%d %H:%M:%S",
+	      gmtime (&commit->date));
+    printf ("%s %s %s %d files +%ld -%ld\n",
+	    branch, date, commit->author, nfiles, added, removed);
+
+    for (fl = diff->add, other = diff->del; fl; fl = fl->next) {
+	f = fl->file;
+	cvs_number_string (&f->number, rev);
+	if (diffstat_has (&other, f->id))
+	    printf ("\t+%ld -%ld\t%s %s\n", f->added, f->removed,
+		    export_filename (f, strip), rev);
+	else
+	    printf ("\t+%ld -0\t%s %s\n", f->lines,
+		    export_filename (f, strip), rev);
+    }
+    for (fl = diff->del, other = diff->add; fl; fl = fl->next)
+	if (!diffstat_has (&other, fl->file->id))
+	    printf ("\t+0 -%ld\t%s removed\n", fl->file->lines,
+		    export_filename (fl->file, strip));
+
+    total_added += added;
+    total_removed += removed;
+    total_commits++;
+    rev_diff_free (diff);
+}
+
+/*
+ * Report the commits of HEAD not already reported for the branch it
+ * came off, oldest first, gathering them newest first into chain as
+ * export_branch does.
+ */
+static void
+diffstat_branch (rev_ref *head, int strip)
+{
+    rev_commit	*commit = head->commit;
+    int		n = 0;
+
+    for (;;) {
+	if (n == chainmax) {
+	    chainmax = chainmax ? chainmax * 2 : 1024;
+	    chain = xrealloc (chain, chainmax * sizeof (rev_commit *));
+	}
+	chain[n++] = commit;
+	if (!commit->parent || commit->tail)
+	    break;
+	commit = commit->parent;
+    }
+    while (n)
+	diffstat_commit (chain[--n], head->name, strip);
+}
+
+void
+diffstat_commits (rev_list *rl, int strip)
+{
+    rev_ref *h;
+
+    total_added = total_removed = 0;
+    total_commits = 0;
+    for (h = rl->heads; h; h = h->next)
+	if (!h->tail)
+	    diffstat_branch (h, strip);
+    free (chain);
+    chain = NULL;
+    chainmax = 0;
+    printf ("%d commits +%ld -%ld\n",
+	    total_commits, total_added, total_removed);
+}
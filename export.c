@@ -17,41 +17,396 @@
  */
 
 #include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include "cvs.h"
 
 static int mark;
 
+/*
+ * Blobs and commits both go to stdout unless --blob-output or
+ * --commit-output name files of their own.  A %d in the blob file name
+ * gives each thread generating blobs a shard of its own, numbered by
+ * generate_slot(); such blobs are written as soon as they are made,
+ * by the thread that made them, with marks handed out beforehand.
+ */
+static out_stream *commit_out, *stdout_stream;
+static out_stream **blob_out;
+static int nblob_out;
+static pthread_mutex_t export_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * With --dedup, blobs are named by their git SHA-1 and a blob already
+ * written is not written again; the revision just takes its mark.
+ */
+typedef struct _blob_seen {
+    unsigned char	sha1[20];
+    int			mark;
+} blob_seen;
+
+static blob_seen *seen;
+static unsigned long nseen, seenmax;
+static unsigned long blobs_written, blobs_reused;
+static unsigned long long bytes_written, bytes_saved;
+
+/*
+ * With --pack, the objects go into a packfile rather than a stream,
+ * and the object each mark stands for is kept here by its name.
+ */
+static unsigned char (*mark_sha)[20];
+static int mark_shamax;
+
+/* export_filename of each file, by id; strip never changes */
+static char **paths;
+static int npaths;
+
+/*
+ * With --inline, blobs get no marks.  Each one is kept in a spool file
+ * until export_commit puts it inline in the commits that use it, and
+ * the mark of a revision numbers its spool entry instead, which only
+ * this file ever sees.
+ */
+typedef struct _spool_entry {
+    off_t		offset;
+    unsigned long	len;
+} spool_entry;
+
+static int spool_fd = -1;
+static out_stream *spool_out;
+static off_t spool_size;
+static spool_entry *spool;
+static int nspool, spoolmax;
+
+typedef struct _tree_entry {
+    char		*path;
+    int			order;
+    mode_t		mode;
+    unsigned char	*sha1;
+} tree_entry;
+
+typedef struct _obj_buf {
+    char		*data;
+    size_t		len, max;
+} obj_buf;
+
 void
 export_init(void)
 {
     mark = 0;
+    if (pack_repo) {
+	pack_open (pack_repo);
+	return;
+    }
+    if (inline_blobs) {
+	char	name[PATH_MAX], *tmpdir = getenv ("TMPDIR");
+
+	snprintf (name, sizeof (name), "%s/parsecvs-spool-XXXXXX",
+		  tmpdir ? tmpdir : "/tmp");
+	if ((spool_fd = mkstemp (name)) < 0) {
+	    fprintf (stderr, "parsecvs: %s: %s\n", name, strerror (errno));
+	    exit (1);
+	}
+	unlink (name);
+	spool_out = stream_fd (spool_fd, "blob spool", false);
+    }
+    if (!commit_output || (!blob_output && !inline_blobs))
+	stdout_stream = stream_fd (STDOUT_FILENO, "standard output",
+				   compress_output);
+    commit_out = commit_output ? stream_open (commit_output, compress_output)
+			       : stdout_stream;
+    nblob_out = blob_shards ? threads : 1;
+    blob_out = xmalloc (nblob_out * sizeof (out_stream *));
+    memset (blob_out, 0, nblob_out * sizeof (out_stream *));
+    if (!blob_output)
+	blob_out[0] = stdout_stream;
+}
+
+void
+export_close (void)
+{
+    int	i;
+
+    free (paths);
+    if (pack_repo) {
+	pack_close ();
+	free (mark_sha);
+	return;
+    }
+    if (spool_out) {
+	stream_close (spool_out);
+	close (spool_fd);
+	free (spool);
+    }
+    for (i = 0; i < nblob_out; i++)
+	if (blob_out[i] && blob_out[i] != stdout_stream)
+	    stream_close (blob_out[i]);
+    free (blob_out);
+    if (commit_out != stdout_stream)
+	stream_close (commit_out);
+    if (stdout_stream)
+	stream_close (stdout_stream);
+}
+
+/* Record SHA1 as the object MARK stands for */
+static void
+mark_set_sha (int mark, unsigned char *sha1)
+{
+    if (mark >= mark_shamax) {
+	int	oldmax = mark_shamax;
+
+	mark_shamax = (mark + 1) * 2;
+	mark_sha = xrealloc (mark_sha, mark_shamax * sizeof (mark_sha[0]));
+	memset (mark_sha + oldmax, 0, (mark_shamax - oldmax) * sizeof (mark_sha[0]));
+    }
+    memcpy (mark_sha[mark], sha1, 20);
+}
+
+/* Make room in the spool for a LEN byte blob, and number it */
+static int
+spool_add (unsigned long len)
+{
+    if (nspool + 1 >= spoolmax) {
+	spoolmax = spoolmax ? spoolmax * 2 : 4096;
+	spool = xrealloc (spool, spoolmax * sizeof (spool_entry));
+    }
+    spool[++nspool].offset = spool_size;
+    spool[nspool].len = len;
+    spool_size += len;
+    return nspool;
+}
+
+/* Copy spool entry N to the commits */
+static void
+spool_copy (int n)
+{
+    static char	    *buf;
+    off_t	    offset = spool[n].offset;
+    unsigned long   left = spool[n].len;
+    ssize_t	    got;
+
+    if (!buf)
+	buf = xmalloc (1 << 20);
+    while (left) {
+	got = pread (spool_fd, buf, left < (1 << 20) ? left : (1 << 20), offset);
+	if (got <= 0) {
+	    fprintf (stderr, "parsecvs: reading blob spool: %s\n",
+		     got < 0 ? strerror (errno) : "short file");
+	    exit (1);
+	}
+	stream_write (commit_out, buf, got);
+	offset += got;
+	left -= got;
+    }
+}
+
+/* The stream blobs made by this thread go to, opened on first use */
+static out_stream *
+export_blob_stream (void)
+{
+    char    name[PATH_MAX];
+    int	    slot = blob_shards ? generate_slot () : 0;
+
+    if (!blob_out[slot]) {
+	pthread_mutex_lock (&export_lock);
+	if (blob_shards)
+	    snprintf (name, sizeof (name), blob_output, slot);
+	else
+	    snprintf (name, sizeof (name), "%s", blob_output);
+	blob_out[slot] = stream_open (name, compress_output);
+	pthread_mutex_unlock (&export_lock);
+    }
+    return blob_out[slot];
+}
+
+/* Give the revisions in NODES, in order, the marks of their blobs */
+void
+export_reserve_marks (Node **nodes, int n)
+{
+    int	i;
+
+    for (i = 0; i < n; i++)
+	nodes[i]->file->mark = ++mark;
+}
+
+/* The mark slot for the blob named SHA1, empty if it is a new one */
+static int *
+blob_mark (unsigned char *sha1)
+{
+    unsigned long   i, h, mask;
+    blob_seen	    *old = seen;
+
+    if (nseen * 2 >= seenmax) {
+	unsigned long	oldmax = seenmax;
+
+	seenmax = seenmax ? seenmax * 2 : 4096;
+	seen = xmalloc (seenmax * sizeof (blob_seen));
+	memset (seen, 0, seenmax * sizeof (blob_seen));
+	mask = seenmax - 1;
+	for (i = 0; i < oldmax; i++) {
+	    if (!old[i].mark)
+		continue;
+	    memcpy (&h, old[i].sha1, sizeof (h));
+	    for (h &= mask; seen[h].mark; h = (h + 1) & mask)
+		;
+	    seen[h] = old[i];
+	}
+	free (old);
+    }
+    mask = seenmax - 1;
+    memcpy (&h, sha1, sizeof (h));
+    for (h &= mask; seen[h].mark; h = (h + 1) & mask)
+	if (memcmp (seen[h].sha1, sha1, 20) == 0)
+	    return &seen[h].mark;
+    memcpy (seen[h].sha1, sha1, 20);
+    nseen++;
+    return &seen[h].mark;
+}
+
+void
+export_dedup_report (void)
+{
+    fprintf (stderr, "Dedup: %lu of %lu blobs were duplicates, "
+	     "%llu of %llu bytes saved\n",
+	     blobs_reused, blobs_written + blobs_reused,
+	     bytes_saved, bytes_written + bytes_saved);
+    free (seen);
+    seen = NULL;
+    nseen = seenmax = 0;
+}
+
+/*
+ * Write the blob in IOV to OUT, straight from the ,v file when the
+ * blob lies there as it is.
+ */
+static void
+export_blob_data (out_stream *out, Node *node, struct iovec *iov, int iovcnt,
+		  unsigned long len)
+{
+    int	fd;
+
+    if (node->textoff && (fd = open (node->file->name, O_RDONLY)) >= 0) {
+	stream_sendfile (out, fd, node->textoff, iov, iovcnt, len);
+	close (fd);
+    } else
+	stream_writev (out, iov, iovcnt, len);
 }
 
 void 
-export_blob(Node *node, void *buf, unsigned long len)
+export_blob(Node *node, struct iovec *iov, int iovcnt, unsigned long len)
 {
-    node->file->mark = ++mark;
+    unsigned char   sha1[20], base[20];
+    int		    *dup = NULL;
+    out_stream	    *out = NULL;
+    Node	    *basenode;
+    char	    *delta;
+    unsigned long   deltalen;
 
-    printf("blob\nmark :%d\ndata %zd\n", 
-	   node->file->mark, len);
-    fwrite(buf, len, sizeof(char), stdout);
-    putchar('\n');
+    /*
+     * The pack keeps one copy of each object whether or not --dedup,
+     * and takes the revision as a delta against the one before it
+     * when it can.
+     */
+    if (pack_repo && (delta = generate_delta (&basenode, &deltalen))) {
+	memset (base, 0, sizeof (base));
+	pthread_mutex_lock (&export_lock);
+	if (basenode->file && basenode->file->mark < mark_shamax)
+	    memcpy (base, mark_sha[basenode->file->mark], 20);
+	pthread_mutex_unlock (&export_lock);
+	pack_delta (iov, iovcnt, len, base, delta, deltalen, sha1);
+    } else if (pack_repo)
+	pack_object (OBJ_BLOB, iov, iovcnt, len, sha1);
+    else {
+	out = inline_blobs ? NULL : export_blob_stream ();
+	if (dedup_blobs)
+	    sha1_object ("blob", iov, iovcnt, len, sha1);
+    }
+    pthread_mutex_lock (&export_lock);
+    if (dedup_blobs) {
+	dup = blob_mark (sha1);
+	if (*dup) {
+	    node->file->mark = *dup;
+	    blobs_reused++;
+	    bytes_saved += len;
+	    pthread_mutex_unlock (&export_lock);
+	    return;
+	}
+    }
+    /* sharded blobs had their marks reserved */
+    if (inline_blobs)
+	node->file->mark = spool_add (len);
+    else if (!node->file->mark)
+	node->file->mark = ++mark;
+    if (dup)
+	*dup = node->file->mark;
+    if (pack_repo)
+	mark_set_sha (node->file->mark, sha1);
+    blobs_written++;
+    bytes_written += len;
+    if (inline_blobs) {
+	/* in the order of the spool entries */
+	export_blob_data (spool_out, node, iov, iovcnt, len);
+	pthread_mutex_unlock (&export_lock);
+	return;
+    }
+    pthread_mutex_unlock (&export_lock);
+    if (pack_repo)
+	return;
+
+    stream_puts (out, "blob\nmark :");
+    stream_uint (out, node->file->mark);
+    stream_puts (out, "\ndata ");
+    stream_uint (out, len);
+    stream_putc (out, '\n');
+    export_blob_data (out, node, iov, iovcnt, len);
+    stream_putc (out, '\n');
 }
 
-static char *
-export_filename (rev_file *file, int strip)
+/* Give NODE the blob SHA1, which the repository being packed has */
+void
+export_blob_known (Node *node, unsigned char *sha1)
+{
+    pthread_mutex_lock (&export_lock);
+    if (!node->file->mark)
+	node->file->mark = ++mark;
+    mark_set_sha (node->file->mark, sha1);
+    pthread_mutex_unlock (&export_lock);
+}
+
+/* The name of the blob export_blob packed for NODE */
+void
+export_blob_sha (Node *node, unsigned char *sha1)
+{
+    pthread_mutex_lock (&export_lock);
+    memcpy (sha1, mark_sha[node->file->mark], 20);
+    pthread_mutex_unlock (&export_lock);
+}
+
+/*
+ * Work out the path the ,v file FILE, numbered ID, has in the export.
+ * Every file is named so before any is loaded, and the threads that
+ * format commits only ever look the paths up.
+ */
+void
+export_name_file (int id, char *file, int strip)
 {
     static char name[PATH_MAX];
     char    *attic;
     int	    l;
     int	    len;
     
-    if (strlen (file->name) - strip >= MAXPATHLEN)
+    if (id >= npaths) {
+	int	oldn = npaths;
+
+	npaths = id + 1024;
+	paths = xrealloc (paths, npaths * sizeof (char *));
+	memset (paths + oldn, 0, (npaths - oldn) * sizeof (char *));
+    }
+    if (strlen (file) - strip >= MAXPATHLEN)
     {
-	fprintf(stderr, "parsecvs: file name %s\n too long\n", file->name);
+	fprintf(stderr, "parsecvs: file name %s\n too long\n", file);
 	exit(1);
     }
-    strcpy (name, file->name + strip);
+    strcpy (name, file + strip);
     while ((attic = strstr (name, "Attic/")) &&
 	   (attic == name || attic[-1] == '/'))
     {
@@ -69,7 +424,15 @@ export_filename (rev_file *file, int strip)
 	name[3] = 't';
     }
 
-    return name;
+    paths[id] = atom (name);
+}
+
+char *
+export_filename (rev_file *file, int strip)
+{
+    if (file->id >= npaths || !paths[file->id])
+	export_name_file (file->id, file->name, strip);
+    return paths[file->id];
 }
 
 static const char *utc_offset_timestamp(const time_t *timep, const char *tz)
@@ -102,6 +465,7 @@ static const char *utc_offset_timestamp(const time_t *timep, const char *tz)
 
 static int export_total_commits;
 static int export_current_commit;
+static int export_status_step;
 static char *export_current_head;
 
 #define STATUS	stderr
@@ -113,6 +477,10 @@ export_status (void)
     int	spot = export_current_commit * PROGRESS_LEN / export_total_commits;
     int	s;
 
+    /* about a hundred lines at most; a line a commit costs more than the commit */
+    if (export_current_commit % export_status_step &&
+	export_current_commit != export_total_commits)
+	return;
     fprintf (STATUS, "Save: %35.35s ", export_current_head);
     for (s = 0; s < PROGRESS_LEN + 1; s++)
 	putc (s == spot ? '*' : '.', STATUS);
@@ -121,141 +489,549 @@ export_status (void)
 }
 
 static void
-export_commit(rev_commit *commit, char *branch, int strip)
+obj_add (obj_buf *b, const void *p, size_t n)
+{
+    if (b->len + n > b->max) {
+	b->max = (b->len + n) * 2;
+	b->data = xrealloc (b->data, b->max);
+    }
+    memcpy (b->data + b->len, p, n);
+    b->len += n;
+}
+
+static void
+obj_puts (obj_buf *b, const char *s)
+{
+    obj_add (b, s, strlen (s));
+}
+
+static void
+obj_uint (obj_buf *b, unsigned long v)
+{
+    char    buf[24], *p = buf + sizeof (buf);
+
+    do
+	*--p = '0' + v % 10;
+    while ((v /= 10));
+    obj_add (b, p, buf + sizeof (buf) - p);
+}
+
+static void
+obj_octal (obj_buf *b, unsigned long v)
+{
+    char    buf[24], *p = buf + sizeof (buf);
+
+    do
+	*--p = '0' + (v & 7);
+    while ((v >>= 3));
+    obj_add (b, p, buf + sizeof (buf) - p);
+}
+
+static void
+obj_sha (obj_buf *b, char *key, unsigned char *sha1)
+{
+    static const char	hex[] = "0123456789abcdef";
+    char		line[48];
+    int			i, n = strlen (key);
+
+    memcpy (line, key, n);
+    for (i = 0; i < 20; i++) {
+	line[n++] = hex[sha1[i] >> 4];
+	line[n++] = hex[sha1[i] & 15];
+    }
+    line[n++] = '\n';
+    obj_add (b, line, n);
+}
+
+static void
+obj_ident (obj_buf *b, char *role, char *full, char *email, const char *ts)
+{
+    obj_puts (b, role);
+    obj_add (b, " ", 1);
+    obj_puts (b, full);
+    obj_add (b, " <", 2);
+    obj_puts (b, email);
+    obj_add (b, "> ", 2);
+    obj_puts (b, ts);
+    obj_add (b, "\n", 1);
+}
+
+/* Put the object in B into the pack, and free it */
+static void
+obj_pack (obj_buf *b, int type, unsigned char *sha1)
+{
+    struct iovec    iov = { b->data, b->len };
+
+    pack_object (type, &iov, 1, b->len, sha1);
+    free (b->data);
+}
+
+static int
+compare_tree_entries (const void *a, const void *b)
+{
+    const tree_entry	*ta = a, *tb = b;
+    int			c = strcmp (ta->path, tb->path);
+
+    return c ? c : ta->order - tb->order;
+}
+
+/*
+ * Pack the tree of the N ENTRIES, sorted by path, whose paths all
+ * start with the PREFIX bytes naming this directory.  Sorting whole
+ * paths bytewise puts each directory's entries together, and in the
+ * order git wants them, since a directory sorts as its name and a '/'.
+ */
+static void
+export_tree (tree_entry *entries, int n, int prefix, unsigned char *sha1)
+{
+    obj_buf	    b = { NULL, 0, 0 };
+    unsigned char   sub[20];
+    char	    *name, *slash;
+    int		    i, j, dirlen;
+
+    for (i = 0; i < n; i = j) {
+	name = entries[i].path + prefix;
+	if ((slash = strchr (name, '/'))) {
+	    dirlen = slash - name + 1;
+	    for (j = i + 1; j < n; j++)
+		if (strncmp (entries[j].path + prefix, name, dirlen) != 0)
+		    break;
+	    export_tree (entries + i, j - i, prefix + dirlen, sub);
+	    obj_add (&b, "40000 ", 6);
+	    obj_add (&b, name, dirlen - 1);
+	    obj_add (&b, "", 1);
+	    obj_add (&b, sub, 20);
+	    continue;
+	}
+	/* of two revisions with the same path, the later one stands */
+	for (j = i + 1; j < n; j++)
+	    if (strcmp (entries[j].path, entries[i].path) != 0)
+		break;
+	obj_puts (&b, entries[j-1].mode & 0100 ? "100755 " : "100644 ");
+	obj_add (&b, name, strlen (name) + 1);
+	obj_add (&b, entries[j-1].sha1, 20);
+    }
+    obj_pack (&b, OBJ_TREE, sha1);
+}
+
+/* Pack the tree of COMMIT, whose files are in ENTRIES, and then the commit */
+static void
+export_commit_pack (rev_commit *commit, tree_entry *entries, int n,
+		    char *full, char *email, const char *ts)
+{
+    obj_buf	    b = { NULL, 0, 0 };
+    unsigned char   sha1[20];
+
+    qsort (entries, n, sizeof (tree_entry), compare_tree_entries);
+    export_tree (entries, n, 0, sha1);
+    obj_sha (&b, "tree ", sha1);
+    if (commit->parent)
+	obj_sha (&b, "parent ", mark_sha[commit->parent->mark]);
+    obj_ident (&b, "author", full, email, ts);
+    obj_ident (&b, "committer", full, email, ts);
+    obj_add (&b, "\n", 1);
+    obj_puts (&b, commit->log);
+    obj_pack (&b, OBJ_COMMIT, sha1);
+    mark_set_sha (commit->mark, sha1);
+}
+
+static void
+export_reset(char *prefix, char *name, int mark)
+{
+    if (pack_repo) {
+	char	ref[PATH_MAX];
+
+	snprintf(ref, sizeof(ref), "%s%s", prefix, name);
+	pack_ref(ref, mark_sha[mark]);
+	return;
+    }
+    stream_puts(commit_out, "reset ");
+    stream_puts(commit_out, prefix);
+    stream_puts(commit_out, name);
+    stream_puts(commit_out, "\nfrom :");
+    stream_uint(commit_out, mark);
+    stream_puts(commit_out, "\n\n");
+}
+
+static void
+tree_entry_set(tree_entry *entries, int n, rev_file *f, char *path)
+{
+    entries[n].path = path;
+    entries[n].order = n;
+    entries[n].mode = f->mode;
+    entries[n].sha1 = mark_sha[f->mark];
+}
+
+/* The file at *DIR, *FILE in COMMIT, moving past empty rev_dirs */
+static rev_file *
+commit_file(rev_commit *commit, int *dir, int *file)
+{
+    if (!commit)
+	return NULL;
+    while (*dir < commit->ndirs && *file >= commit->dirs[*dir]->nfiles) {
+	(*dir)++;
+	*file = 0;
+    }
+    return *dir < commit->ndirs ? commit->dirs[*dir]->files[*file] : NULL;
+}
+
+/*
+ * Commits are formatted into buffers a batch at a time, on the -j
+ * threads when there are several, and written out in order.  Their
+ * marks and timestamps are fixed first, on this thread: a commit
+ * names its parent by mark, and a timestamp is made by changing TZ.
+ * An inline blob is not copied into the buffer, but out of the spool
+ * as the commit is written, at the offset its splice gives.  With
+ * --pack, a commit needs its parent's object name and so is made in
+ * turn, one at a time.
+ */
+#define COMMIT_BATCH	256
+
+typedef struct _blob_splice {
+    size_t		at;
+    int			mark;
+} blob_splice;
+
+typedef struct _commit_job {
+    rev_commit		*commit;
+    char		*branch;
+    char		*full, *email;
+    char		ts[64];
+    bool		done;
+    obj_buf		out;		/* the commit for the stream */
+    obj_buf		revmap;		/* its --revision-map lines */
+    blob_splice		*splices;
+    int			nsplices, splicemax;
+    rev_file		**gone;		/* files of the parent it lacks */
+    int			ngone, gonemax;
+    tree_entry		*entries;	/* with --pack, its whole tree */
+    int			nentries, entriesmax;
+} commit_job;
+
+static commit_job jobs[COMMIT_BATCH];
+static int njobs, next_job;
+static bool jobs_over;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+
+static void
+job_gone(commit_job *job, rev_file *f)
+{
+    if (job->ngone == job->gonemax) {
+	job->gonemax = job->gonemax ? job->gonemax * 2 : 256;
+	job->gone = xrealloc(job->gone, job->gonemax * sizeof(rev_file *));
+    }
+    job->gone[job->ngone++] = f;
+}
+
+static void
+job_splice(commit_job *job, int mark)
+{
+    if (job->nsplices == job->splicemax) {
+	job->splicemax = job->splicemax ? job->splicemax * 2 : 16;
+	job->splices = xrealloc(job->splices,
+				job->splicemax * sizeof(blob_splice));
+    }
+    job->splices[job->nsplices].at = job->out.len;
+    job->splices[job->nsplices++].mark = mark;
+}
+
+/* Make ready to format COMMIT on BRANCH, giving it the next mark */
+static void
+export_prepare(commit_job *job, rev_commit *commit, char *branch)
 {
     cvs_author *author;
-    char *full;
-    char *email;
     char *timezone;
-    char *revpairs = NULL;
-    size_t revpairsize = 0;
-    const char *ts;
     time_t ct;
-    rev_file	*f, *f2;
-    int		i, j, i2, j2;
 
     author = fullname(commit->author);
     if (!author) {
-	full = commit->author;
-	email = commit->author;
+	job->full = commit->author;
+	job->email = commit->author;
 	timezone = "UTC";
     } else {
-	full = author->full;
-	email = author->email;
+	job->full = author->full;
+	job->email = author->email;
 	timezone = author->timezone ? author->timezone : "UTC";
     }
 
-    printf("commit refs/heads/%s\n", branch);
-    printf("mark :%d\n", ++mark);
-    commit->mark = mark;
+    commit->mark = ++mark;
     ct = force_dates ? mark * commit_time_window * 2 : commit->date;
-    ts = utc_offset_timestamp(&ct, timezone);
-    printf("author %s <%s> %s\n", full, email, ts);
-    printf("committer %s <%s> %s\n", full, email, ts);
-    printf("data %zd\n%s\n", strlen(commit->log), commit->log);
-    if (commit->parent)
-	printf("from :%d\n", commit->parent->mark);
+    snprintf(job->ts, sizeof(job->ts), "%s", utc_offset_timestamp(&ct, timezone));
+    job->commit = commit;
+    job->branch = branch;
+    job->done = false;
+    job->out.len = job->revmap.len = 0;
+    job->nsplices = job->ngone = job->nentries = 0;
+}
 
-    if (reposurgeon)
-    {
-	revpairs = xmalloc((revpairsize = 1024));
-	revpairs[0] = '\0';
+/* Format the commit of JOB, on any thread; with --pack, on this one only */
+static void
+export_format(commit_job *job, int strip)
+{
+    rev_commit	*commit = job->commit;
+    rev_commit	*parent = commit->parent;
+    rev_file	*f, *f2;
+    int		i, j, pdir, pfile, cmp;
+    obj_buf	revpairs = { NULL, 0, 0 };
+    char	rev[CVS_MAX_REV_LEN + 1];
+
+    if (pack_repo) {
+	/* a pack commit names its whole tree, not the changes */
+	for (i = 0, j = 0; i < commit->ndirs; i++)
+	    j += commit->dirs[i]->nfiles;
+	if (j > job->entriesmax) {
+	    job->entriesmax = j;
+	    job->entries = xrealloc(job->entries,
+				    job->entriesmax * sizeof(tree_entry));
+	}
+    } else {
+	obj_puts(&job->out, "commit refs/heads/");
+	obj_puts(&job->out, job->branch);
+	obj_puts(&job->out, "\nmark :");
+	obj_uint(&job->out, commit->mark);
+	obj_add(&job->out, "\n", 1);
+	obj_ident(&job->out, "author", job->full, job->email, job->ts);
+	obj_ident(&job->out, "committer", job->full, job->email, job->ts);
+	obj_puts(&job->out, "data ");
+	obj_uint(&job->out, strlen(commit->log));
+	obj_add(&job->out, "\n", 1);
+	obj_puts(&job->out, commit->log);
+	obj_add(&job->out, "\n", 1);
+	if (parent) {
+	    obj_puts(&job->out, "from :");
+	    obj_uint(&job->out, parent->mark);
+	    obj_add(&job->out, "\n", 1);
+	}
     }
 
+    /*
+     * The files of a commit and of its parent are both in id order,
+     * which is name order, so one pass over the two finds what was
+     * added, changed and removed.  A rev_dir the parent has as well
+     * holds the very same files, and is passed over whole.
+     */
+    pdir = pfile = 0;
     for (i = 0; i < commit->ndirs; i++) {
 	rev_dir	*dir = commit->dirs[i];
-	
+
+	if (!dir->nfiles)
+	    continue;
+	while ((f2 = commit_file(parent, &pdir, &pfile)) &&
+	       f2->id < dir->files[0]->id) {
+	    job_gone(job, f2);
+	    pfile++;
+	}
+	if (f2 && pfile == 0 && parent->dirs[pdir] == dir) {
+	    pdir++;
+	    if (pack_repo)
+		for (j = 0; j < dir->nfiles; j++)
+		    tree_entry_set(job->entries, job->nentries++, dir->files[j],
+				   export_filename(dir->files[j], strip));
+	    continue;
+	}
 	for (j = 0; j < dir->nfiles; j++) {
 	    char *stripped;
 	    bool present, changed;
 	    f = dir->files[j];
 	    stripped = export_filename(f, strip);
+	    if (pack_repo)
+		tree_entry_set(job->entries, job->nentries++, f, stripped);
 	    present = false;
 	    changed = false;
-	    if (commit->parent) {
-		for (i2 = 0; i2 < commit->parent->ndirs; i2++) {
-		    rev_dir	*dir2 = commit->parent->dirs[i2];
-		    for (j2 = 0; j2 < dir2->nfiles; j2++) {
-			f2 = dir2->files[j2];
-			if (strcmp(f->name, f2->name) == 0) {
-			    present = true;
-			    changed = (f->mark != f2->mark);
-			}
-		    }
+	    while ((f2 = commit_file(parent, &pdir, &pfile)) &&
+		   (cmp = f2->id - f->id) <= 0) {
+		pfile++;
+		if (cmp < 0) {
+		    job_gone(job, f2);
+		    continue;
 		}
+		present = true;
+		/* with --dedup, revisions may share a blob */
+		changed = (f->mark != f2->mark ||
+			   cvs_number_compare (&f->number, &f2->number) != 0);
+		break;
 	    }
 	    if (!present || changed) {
-		printf("M 100%o :%d %s\n", 
-		       (f->mode & 0777) | 0200, 
-		       f->mark, stripped);
+		if (inline_blobs) {
+		    obj_puts(&job->out, "M 100");
+		    obj_octal(&job->out, (f->mode & 0777) | 0200);
+		    obj_puts(&job->out, " inline ");
+		    obj_puts(&job->out, stripped);
+		    obj_puts(&job->out, "\ndata ");
+		    obj_uint(&job->out, spool[f->mark].len);
+		    obj_add(&job->out, "\n", 1);
+		    job_splice(job, f->mark);
+		    obj_add(&job->out, "\n", 1);
+		} else if (!pack_repo) {
+		    obj_puts(&job->out, "M 100");
+		    obj_octal(&job->out, (f->mode & 0777) | 0200);
+		    obj_puts(&job->out, " :");
+		    obj_uint(&job->out, f->mark);
+		    obj_add(&job->out, " ", 1);
+		    obj_puts(&job->out, stripped);
+		    obj_add(&job->out, "\n", 1);
+		}
 		if (revision_map || reposurgeon) {
-		    char *fr = stringify_revision(stripped, " ", &f->number);
-		    if (revision_map)
-			fprintf(revision_map, "%s :%d\n", fr, f->mark);
-		    if (reposurgeon)
-		    {
-			if (strlen(revpairs) + strlen(fr) + 2 > revpairsize)
-			{
-			    revpairsize += strlen(fr) + 2;
-			    revpairs = xrealloc(revpairs, revpairsize);
-			}
-			strcat(revpairs, fr);
-			strcat(revpairs, "\n");
+		    cvs_number_string(&f->number, rev);
+		    if (revision_map) {
+			obj_puts(&job->revmap, stripped);
+			obj_add(&job->revmap, " ", 1);
+			obj_puts(&job->revmap, rev);
+			obj_puts(&job->revmap, " :");
+			obj_uint(&job->revmap,
+				 inline_blobs ? commit->mark : f->mark);
+			obj_add(&job->revmap, "\n", 1);
+		    }
+		    if (reposurgeon && !pack_repo) {
+			obj_puts(&revpairs, stripped);
+			obj_add(&revpairs, " ", 1);
+			obj_puts(&revpairs, rev);
+			obj_add(&revpairs, "\n", 1);
 		    }
 		}
 	    }
 	}
     }
+    while ((f2 = commit_file(parent, &pdir, &pfile))) {
+	job_gone(job, f2);
+	pfile++;
+    }
 
-    if (commit->parent)
-    {
-	for (i = 0; i < commit->parent->ndirs; i++) {
-	    rev_dir	*dir = commit->parent->dirs[i];
-
-	    for (j = 0; j < dir->nfiles; j++) {
-		bool present;
-		f = dir->files[j];
-		present = false;
-		for (i2 = 0; i2 < commit->ndirs; i2++) {
-		    rev_dir	*dir2 = commit->dirs[i2];
-		    for (j2 = 0; j2 < dir2->nfiles; j2++) {
-			f2 = dir2->files[j2];
-			if (strcmp(f->name, f2->name) == 0) {
-			    present = true;
-			}
-		    }
-		}
-		if (!present)
-		    printf("D %s\n", export_filename(f, strip));
-	    }
-	}
+    if (pack_repo)
+	return;
+
+    /* removals go after the changes, in name order */
+    for (i = 0; i < job->ngone; i++) {
+	obj_puts(&job->out, "D ");
+	obj_puts(&job->out, export_filename(job->gone[i], strip));
+	obj_add(&job->out, "\n", 1);
     }
 
     if (reposurgeon) 
     {
-	printf("property cvs-revision %zd %s", strlen(revpairs), revpairs);
-	free(revpairs);
+	obj_puts(&job->out, "property cvs-revision ");
+	obj_uint(&job->out, revpairs.len);
+	obj_add(&job->out, " ", 1);
+	if (revpairs.len)
+	    obj_add(&job->out, revpairs.data, revpairs.len);
+	free(revpairs.data);
     }
 
-    printf ("\n");
+    obj_add(&job->out, "\n", 1);
+}
+
+/* Write out the commit JOB formatted */
+static void
+export_write(commit_job *job)
+{
+    size_t	at = 0;
+    int		i;
 
+    if (revision_map && job->revmap.len)
+	fwrite(job->revmap.data, 1, job->revmap.len, revision_map);
+    if (pack_repo) {
+	export_commit_pack(job->commit, job->entries, job->nentries,
+			   job->full, job->email, job->ts);
+	return;
+    }
+    for (i = 0; i < job->nsplices; i++) {
+	stream_write(commit_out, job->out.data + at, job->splices[i].at - at);
+	spool_copy(job->splices[i].mark);
+	at = job->splices[i].at;
+    }
+    stream_write(commit_out, job->out.data + at, job->out.len - at);
 }
 
-static int
-export_commit_recurse (rev_ref *head, rev_commit *commit, int strip)
+static int export_strip;
+
+static void *
+export_worker(void *arg)
 {
-    Tag *t;
-    
-    if (commit->parent && !commit->tail)
-	    if (!export_commit_recurse (head, commit->parent, strip))
-		return 0;
-    ++export_current_commit;
-    export_status ();
-    export_commit (commit, head->name, strip);
-    for (t = all_tags; t; t = t->next)
-	if (t->commit == commit)
-	    printf("reset refs/tags/%s\nfrom :%d\n\n", t->name, commit->mark);
-    return 1;
+    int	i;
+
+    pthread_mutex_lock(&job_lock);
+    for (;;) {
+	while (next_job == njobs && !jobs_over)
+	    pthread_cond_wait(&job_ready, &job_lock);
+	if (next_job == njobs)
+	    break;
+	i = next_job++;
+	pthread_mutex_unlock(&job_lock);
+	export_format(&jobs[i], export_strip);
+	pthread_mutex_lock(&job_lock);
+	jobs[i].done = true;
+	pthread_cond_broadcast(&job_done);
+    }
+    pthread_mutex_unlock(&job_lock);
+    return NULL;
+}
+
+/* Wait for job I to be formatted, formatting the next ones meanwhile */
+static void
+export_wait(int i)
+{
+    int	k;
+
+    pthread_mutex_lock(&job_lock);
+    while (!jobs[i].done) {
+	if (next_job < njobs) {
+	    k = next_job++;
+	    pthread_mutex_unlock(&job_lock);
+	    export_format(&jobs[k], export_strip);
+	    pthread_mutex_lock(&job_lock);
+	    jobs[k].done = true;
+	} else
+	    pthread_cond_wait(&job_done, &job_lock);
+    }
+    pthread_mutex_unlock(&job_lock);
+}
+
+static rev_commit **chain;
+static int chainmax;
+
+/*
+ * Write the commits of HEAD not already written by the branch it
+ * came off, oldest first.  They are gathered newest first into chain
+ * rather than on the stack, which a long branch would overrun.
+ */
+static void
+export_branch (rev_ref *head)
+{
+    rev_commit		*commit = head->commit;
+    Tag			*t;
+    int			n = 0, i, batch;
+
+    for (;;) {
+	if (n == chainmax) {
+	    chainmax = chainmax ? chainmax * 2 : 1024;
+	    chain = xrealloc (chain, chainmax * sizeof (rev_commit *));
+	}
+	chain[n++] = commit;
+	if (!commit->parent || commit->tail)
+	    break;
+	commit = commit->parent;
+    }
+    while (n) {
+	batch = n < COMMIT_BATCH ? n : COMMIT_BATCH;
+	for (i = 0; i < batch; i++)
+	    export_prepare (&jobs[i], chain[--n], head->name);
+	pthread_mutex_lock (&job_lock);
+	njobs = batch;
+	next_job = 0;
+	pthread_cond_broadcast (&job_ready);
+	pthread_mutex_unlock (&job_lock);
+	for (i = 0; i < batch; i++) {
+	    export_wait (i);
+	    ++export_current_commit;
+	    export_status ();
+	    export_write (&jobs[i]);
+	    commit = jobs[i].commit;
+	    for (t = commit_tags (commit); t; t = t->commit_next)
+		export_reset("refs/tags/", t->name, commit->mark);
+	}
+    }
 }
 
 static int
@@ -277,21 +1053,119 @@ export_ncommit (rev_list *rl)
     return n;
 }
 
+static rev_dir	**dirs_seen;
+static unsigned long ndirs_seen, dirs_seenmax;
+
+/* Whether DIR was seen before; it has been now */
+static bool
+dir_seen (rev_dir *dir)
+{
+    rev_dir	    **old = dirs_seen;
+    unsigned long   i, h, mask;
+
+    if (ndirs_seen * 2 >= dirs_seenmax) {
+	unsigned long	oldmax = dirs_seenmax;
+
+	dirs_seenmax = dirs_seenmax ? dirs_seenmax * 2 : 4096;
+	dirs_seen = xmalloc (dirs_seenmax * sizeof (rev_dir *));
+	memset (dirs_seen, 0, dirs_seenmax * sizeof (rev_dir *));
+	mask = dirs_seenmax - 1;
+	for (i = 0; i < oldmax; i++) {
+	    if (!old[i])
+		continue;
+	    for (h = ((uintptr_t) old[i] >> 4) & mask; dirs_seen[h]; h = (h + 1) & mask)
+		;
+	    dirs_seen[h] = old[i];
+	}
+	free (old);
+    }
+    mask = dirs_seenmax - 1;
+    for (h = ((uintptr_t) dir >> 4) & mask; dirs_seen[h]; h = (h + 1) & mask)
+	if (dirs_seen[h] == dir)
+	    return true;
+    dirs_seen[h] = dir;
+    ndirs_seen++;
+    return false;
+}
+
+/*
+ * Mark the files of every commit export_commits will write as used.
+ * Commits share most of their rev_dirs, so each is gone through once.
+ */
+void
+export_used_files (rev_list *rl)
+{
+    rev_ref	*h;
+    rev_commit	*c;
+    rev_dir	*dir;
+    int		i, j;
+
+    for (h = rl->heads; h; h = h->next) {
+	if (h->tail)
+	    continue;
+	for (c = h->commit; c; c = c->parent) {
+	    for (i = 0; i < c->ndirs; i++) {
+		dir = c->dirs[i];
+		if (dir_seen (dir))
+		    continue;
+		for (j = 0; j < dir->nfiles; j++)
+		    dir->files[j]->used = true;
+	    }
+	    if (c->tail)
+		break;
+	}
+    }
+    free (dirs_seen);
+    dirs_seen = NULL;
+    ndirs_seen = dirs_seenmax = 0;
+}
+
 bool
 export_commits (rev_list *rl, int strip)
 {
-    rev_ref *h;
+    rev_ref	*h;
+    pthread_t	*workers = NULL;
+    int		i, nworkers = 0;
 
+    /* every blob is in the spool before the first commit */
+    if (spool_out)
+	stream_flush (spool_out);
+    index_tags ();
     export_total_commits = export_ncommit (rl);
     export_current_commit = 0;
+    export_status_step = export_total_commits / 100 + 1;
+    export_strip = strip;
+    if (threads > 1 && !pack_repo) {
+	workers = xmalloc (sizeof (pthread_t) * (threads - 1));
+	for (i = 0; i < threads - 1; i++)
+	    if (pthread_create (&workers[nworkers], NULL,
+				export_worker, NULL) == 0)
+		nworkers++;
+    }
     for (h = rl->heads; h; h = h->next) 
     {
 	export_current_head = h->name;
 	if (!h->tail)
-	    if (!export_commit_recurse (h, h->commit, strip))
-		return false;
-	printf("reset refs/heads/%s\nfrom :%d\n\n", h->name, h->commit->mark);
+	    export_branch (h);
+	export_reset("refs/heads/", h->name, h->commit->mark);
+    }
+    pthread_mutex_lock (&job_lock);
+    jobs_over = true;
+    pthread_cond_broadcast (&job_ready);
+    pthread_mutex_unlock (&job_lock);
+    for (i = 0; i < nworkers; i++)
+	pthread_join (workers[i], NULL);
+    free (workers);
+    for (i = 0; i < COMMIT_BATCH; i++) {
+	free (jobs[i].out.data);
+	free (jobs[i].revmap.data);
+	free (jobs[i].splices);
+	free (jobs[i].gone);
+	free (jobs[i].entries);
     }
+    free (chain);
+    chain = NULL;
+    chainmax = 0;
     fprintf (STATUS, "\n");
     return true;
 }
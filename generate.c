@@ -26,6 +26,7 @@
  */
 #include <limits.h>
 #include <stdarg.h>
+#include <pthread.h>
 #include "cvs.h"
 
 typedef unsigned char uchar;
@@ -49,6 +50,13 @@ struct diffcmd {
 	long line1, nlines, adprev, dafter;
 };
 
+/* an edit command of a delta, its added lines being Gtext[text ...] */
+struct editcmd {
+	int add;
+	long line1, nlines;
+	unsigned long text;
+};
+
 const int initial_out_buffer_size = 1024;
 char const ciklog[] = "checked in with -k by ";
 
@@ -69,16 +77,47 @@ enum stringwork {ENTER, EDIT};
 
 enum expand_mode {EXPANDKKV, EXPANDKKVL, EXPANDKK, EXPANDKV, EXPANDKO, EXPANDKB};
 enum expand_mode Gexpand;
-char * Glog;
-int Gkvlen = 0;
-char* Gkeyval = NULL;
 char const *Gfilename;
-char *Gabspath;
-cvs_version *Gversion;
-char Gversion_number[CVS_MAX_REV_LEN];
-struct out_buffer_type *Goutbuf;
-struct in_buffer_type in_buffer_store;
-struct in_buffer_type *Ginbuf = &in_buffer_store;
+
+/*
+ * With --threads the branches of a file are generated by several
+ * threads at once, so everything below that changes as revisions are
+ * built is kept per thread.
+ */
+__thread char * Glog;
+__thread int Gkvlen = 0;
+__thread char* Gkeyval = NULL;
+__thread char *Gabspath;
+__thread cvs_version *Gversion;
+__thread char Gversion_number[CVS_MAX_REV_LEN];
+__thread struct out_buffer_type *Goutbuf;
+__thread struct in_buffer_type in_buffer_store;
+#define Ginbuf (&in_buffer_store)
+
+/*
+ * With --line-store=rope the lines of the edit buffer live in an
+ * implicit treap ordered by position instead, so that an edit command
+ * costs O(log n) however far it is from the previous one.  Each node
+ * carries one line and the size of its subtree; priorities are random.
+ */
+struct rope {
+	struct rope *left, *right;
+	uchar *line;
+	unsigned long size;
+	unsigned int prio;
+};
+
+/*
+ * Binary (-kb) files never have their lines indexed.  A revision is a
+ * list of pieces instead, each a byte range of a deltatext holding
+ * NLINES whole lines (@s still doubled), so a large tarball costs a
+ * handful of pieces rather than a pointer per line.
+ */
+struct piece {
+	uchar *text;
+	size_t len;
+	unsigned long nlines;
+};
 
 /*
  * Gline contains pointers to the lines in the currently edit buffer
@@ -88,17 +127,86 @@ struct in_buffer_type *Ginbuf = &in_buffer_store;
  * Any @s in lines are duplicated.
  * Lines are terminated by \n, or (for a last partial line only) by single @.
  */
-static int depth;
-static struct {
+struct level {
 	Node *next_branch;
 	Node *node;
 	uchar **line;
 	size_t gap, gapsize, linemax;
-} stack[CVS_MAX_DEPTH/2];
+	struct rope *rope;
+	struct piece *piece;
+	size_t npiece, piecemax;
+	Node *emitted;		/* the revision last emitted from here */
+	unsigned long *offset;	/* where each of its lines started in it */
+	size_t noffset, offsetmax;
+};
+static __thread int depth;
+static __thread struct level stack[CVS_MAX_DEPTH/2];
 #define Gline stack[depth].line
 #define Ggap stack[depth].gap
 #define Ggapsize stack[depth].gapsize
 #define Glinemax stack[depth].linemax
+#define Grope stack[depth].rope
+#define Gpiece stack[depth].piece
+#define Gnpiece stack[depth].npiece
+#define Gpiecemax stack[depth].piecemax
+
+static bool Gbinary;
+
+/*
+ * The deltatext being applied, indexed once before any edit is made.
+ * Gtext holds the start of each of its lines, found with memchr rather
+ * than a character at a time, and Gcmd its parsed edit commands.  The
+ * edit engines work from these two tables only.
+ */
+static __thread uchar **Gtext;
+static __thread unsigned long Gntext, Gtextmax;
+static __thread struct editcmd *Gcmd;
+static __thread unsigned long Gncmd, Gcmdmax;
+
+/*
+ * A revision copied verbatim is handed out as slices of the ,v texts
+ * rather than copied: Giov holds Gniov slices, Giovlen bytes in all.
+ * Lines that follow each other in a text share a slice.
+ */
+static __thread struct iovec *Giov;
+static __thread int Gniov, Giovmax;
+static __thread unsigned long Giovlen;
+
+/*
+ * Handing the kernel a slice costs about as much as copying a few
+ * hundred bytes, so runs of slices shorter than SLICE_COPY are copied
+ * together into STAGE_CHUNK sized buffers and go out as one.  The
+ * buffers are kept from one revision to the next.
+ */
+#define SLICE_COPY 512
+#define STAGE_CHUNK 65536
+static __thread char **Gstage;
+static __thread int Gnstage, Gstagecur;
+static __thread size_t Gstageused;
+static __thread bool Gstagerun;
+
+/*
+ * With --pack, a revision made from the one emitted just before it on
+ * the same level is also handed out as a git delta against it, made
+ * straight from the edit commands: the lines a delta keeps are copied
+ * from the old revision, by the offsets the level kept of its lines,
+ * and the lines it adds are inserted.  A line with a $ in it may come
+ * out differently in each revision, so it is always inserted.
+ */
+static bool Gdeltas;
+static __thread Node *Gdeltabase;
+static __thread unsigned long *Goffset;
+static __thread size_t Gnoffset, Goffsetmax;
+static __thread bool *Gkeyline;
+static __thread size_t Gkeylinemax;
+static __thread uchar *Gdelta;
+static __thread size_t Gdeltalen, Gdeltamax;
+static __thread bool Gdeltaready;
+static __thread int Gdeltaiov;
+static __thread unsigned long Gdeltaiovstart;
+
+static __thread struct rope *rope_freelist;
+static __thread unsigned int rope_seed = 2463534242U;
 
 static void fatal_system_error(char const *s)
 {
@@ -172,18 +280,6 @@ static int in_buffer_getc(void)
 	return c ;
 }
 
-static uchar * in_get_line(void)
-{
-	int c;
-	uchar *ptr = Ginbuf->ptr;
-	c=in_buffer_getc();
-	if (c == EOF)
-		return NULL;
-	while (c != EOF && c != '\n')
-		c = in_buffer_getc();
-	return ptr;
-}
-
 static uchar * in_buffer_loc(void)
 {
 	return(Ginbuf->ptr);
@@ -267,8 +363,10 @@ static int out_fputs(const char *s)
 
 static void out_awrite(char const *s, size_t len)
 {
-	while (len--)
-		out_putc(*s++);
+	while ((size_t) (Goutbuf->end_of_text - Goutbuf->ptr) <= len)
+		out_buffer_enlarge();
+	memcpy(Goutbuf->ptr, s, len);
+	Goutbuf->ptr += len;
 }
 
 static int latin1_alpha(int c)
@@ -413,55 +511,256 @@ static void deletelines(unsigned long n, unsigned long nlines)
 	Ggapsize += nlines;
 }
 
-static long parsenum(void)
+static struct rope *rope_new(uchar *l)
 {
-	int c;
-	long ret = 0;
-	for(c=in_buffer_getc(); isdigit(c); c=in_buffer_getc())
-		ret = (ret * 10) + (c - '0');
-	in_buffer_ungetc();
-	return ret;
+	struct rope *r = rope_freelist;
+	if (r)
+		rope_freelist = r->left;
+	else
+		r = xmalloc(sizeof(struct rope));
+	/* xorshift32 */
+	rope_seed ^= rope_seed << 13;
+	rope_seed ^= rope_seed >> 17;
+	rope_seed ^= rope_seed << 5;
+	r->prio = rope_seed;
+	r->left = r->right = NULL;
+	r->line = l;
+	r->size = 1;
+	return r;
 }
 
-static int parse_next_delta_command(struct diffcmd *dc)
+static void rope_free(struct rope *r)
 {
-	int cmd;
-	long line1, nlines;
+	while (r) {
+		struct rope *right = r->right;
+		rope_free(r->left);
+		r->left = rope_freelist;
+		rope_freelist = r;
+		r = right;
+	}
+}
+
+static void rope_discard(void)
+{
+	struct rope *r;
+	while ((r = rope_freelist)) {
+		rope_freelist = r->left;
+		free(r);
+	}
+}
 
-	cmd = in_buffer_getc();
-	if (cmd==EOF)
-		return -1;
+static inline unsigned long rope_size(struct rope *r)
+{
+	return r ? r->size : 0;
+}
 
-	line1 = parsenum();
+static inline struct rope *rope_update(struct rope *r)
+{
+	r->size = rope_size(r->left) + rope_size(r->right) + 1;
+	return r;
+}
 
-	while (in_buffer_getc() == ' ')
-		;
-	in_buffer_ungetc();
+/* Split R so that *A holds its first N lines and *B the rest */
+static void rope_split(struct rope *r, unsigned long n,
+		       struct rope **a, struct rope **b)
+{
+	if (!r) {
+		*a = *b = NULL;
+	} else if (rope_size(r->left) < n) {
+		rope_split(r->right, n - rope_size(r->left) - 1, &r->right, b);
+		*a = rope_update(r);
+	} else {
+		rope_split(r->left, n, a, &r->left);
+		*b = rope_update(r);
+	}
+}
 
-	nlines = parsenum();
+static struct rope *rope_merge(struct rope *a, struct rope *b)
+{
+	if (!a)
+		return b;
+	if (!b)
+		return a;
+	if (a->prio > b->prio) {
+		a->right = rope_merge(a->right, b);
+		return rope_update(a);
+	}
+	b->left = rope_merge(a, b->left);
+	return rope_update(b);
+}
 
-	while (in_buffer_getc() != '\n')
-		;
+static unsigned long rope_fix_sizes(struct rope *r)
+{
+	if (!r)
+		return 0;
+	r->size = rope_fix_sizes(r->left) + rope_fix_sizes(r->right) + 1;
+	return r->size;
+}
+
+/* Build a treap holding lines L[0 .. N-1] in linear time */
+static struct rope *rope_build(uchar **l, unsigned long n)
+{
+	struct rope **spine, *r, *last;
+	unsigned long i, top = 0;
 
-	if (!nlines || (cmd != 'a' && cmd != 'd') || line1+nlines < line1)
+	if (!n)
+		return NULL;
+	spine = xmalloc(sizeof(struct rope *) * n);
+	for (i = 0; i < n; i++) {
+		r = rope_new(l[i]);
+		last = NULL;
+		while (top && spine[top-1]->prio < r->prio)
+			last = spine[--top];
+		r->left = last;
+		if (top)
+			spine[top-1]->right = r;
+		spine[top++] = r;
+	}
+	r = spine[0];
+	free(spine);
+	rope_fix_sizes(r);
+	return r;
+}
+
+static struct rope *rope_copy(struct rope *r)
+{
+	struct rope *c;
+	if (!r)
+		return NULL;
+	c = rope_new(r->line);
+	c->prio = r->prio;
+	c->size = r->size;
+	c->left = rope_copy(r->left);
+	c->right = rope_copy(r->right);
+	return c;
+}
+
+static void rope_walk(struct rope *r, void (*fn)(uchar *))
+{
+	while (r) {
+		rope_walk(r->left, fn);
+		fn(r->line);
+		r = r->right;
+	}
+}
+
+/* Before line N, insert lines L[0 .. COUNT-1] */
+static void rope_insert(unsigned long n, uchar **l, unsigned long count)
+{
+	struct rope *a, *b;
+	if (n > rope_size(Grope))
+		fatal_error("edit script tried to insert beyond eof");
+	rope_split(Grope, n, &a, &b);
+	Grope = rope_merge(rope_merge(a, rope_build(l, count)), b);
+}
+
+/* Delete lines N through N+NLINES-1.  N is 0-origin.  */
+static void rope_delete(unsigned long n, unsigned long nlines)
+{
+	struct rope *a, *b, *c;
+	unsigned long l = n + nlines;
+	if (rope_size(Grope) < l  ||  l < n)
+		fatal_error("edit script tried to delete beyond eof");
+	rope_split(Grope, n, &a, &b);
+	rope_split(b, nlines, &b, &c);
+	rope_free(b);
+	Grope = rope_merge(a, c);
+}
+
+/*
+ * Fill Gtext with the start of each line of the LEN byte deltatext
+ * TEXT.  Its @s are doubled, so no \n can hide in one and the lines
+ * can be split with memchr; the last one may end at the closing @.
+ */
+static void index_text(uchar *text, size_t len)
+{
+	uchar *p, *end, *nl;
+
+	if (len < 2 || *text != SDELIM)
+		fatal_error("Illegal buffer, missing @ %s", text);
+	p = text + 1;
+	end = text + len - 1;
+	Gntext = 0;
+	while (p < end) {
+		if (Gntext == Gtextmax) {
+			Gtextmax = Gtextmax ? Gtextmax << 1 : 1024;
+			Gtext = xrealloc(Gtext, sizeof(uchar *) * Gtextmax);
+		}
+		Gtext[Gntext++] = p;
+		if (!(nl = memchr(p, '\n', end - p)))
+			break;
+		p = nl + 1;
+	}
+}
+
+static long parsenum(uchar **p)
+{
+	long ret = 0;
+	while (isdigit(**p))
+		ret = (ret * 10) + (*(*p)++ - '0');
+	return ret;
+}
+
+/*
+ * Parse the edit command at P into DC, checking that it follows the
+ * previous one.  Return whether it is an add.
+ */
+static int parse_command(uchar *p, struct diffcmd *dc)
+{
+	int cmd = *p++;
+
+	dc->line1 = parsenum(&p);
+	while (*p == ' ')
+		p++;
+	dc->nlines = parsenum(&p);
+
+	if (!dc->nlines || (cmd != 'a' && cmd != 'd') ||
+	    dc->line1 + dc->nlines < dc->line1)
 		fatal_error("Corrupt delta");
 
 	if (cmd == 'a') {
-		if (line1 < dc->adprev)
+		if (dc->line1 < dc->adprev)
 			fatal_error("backward insertion in delta");
-		dc->adprev = line1 + 1;
-	} else if (cmd == 'd') {
-		if (line1 < dc->adprev  ||  line1 < dc->dafter)
+		dc->adprev = dc->line1 + 1;
+	} else {
+		if (dc->line1 < dc->adprev  ||  dc->line1 < dc->dafter)
 			fatal_error("backward deletion in delta");
-		dc->adprev = line1;
-		dc->dafter = line1 + nlines;
+		dc->adprev = dc->line1;
+		dc->dafter = dc->line1 + dc->nlines;
 	}
-
-	dc->line1 = line1;
-	dc->nlines = nlines;
 	return cmd == 'a';
 }
 
+/* Parse the indexed deltatext into Gcmd, checking that it is sorted */
+static void index_delta(void)
+{
+	struct diffcmd dc;
+	struct editcmd *c;
+	unsigned long i = 0;
+	int add;
+
+	dc.dafter = dc.adprev = 0;
+	Gncmd = 0;
+	while (i < Gntext) {
+		add = parse_command(Gtext[i++], &dc);
+
+		if (Gncmd == Gcmdmax) {
+			Gcmdmax = Gcmdmax ? Gcmdmax << 1 : 64;
+			Gcmd = xrealloc(Gcmd, sizeof(struct editcmd) * Gcmdmax);
+		}
+		c = &Gcmd[Gncmd++];
+		c->add = add;
+		c->line1 = dc.line1;
+		c->nlines = dc.nlines;
+		c->text = i;
+		if (c->add) {
+			if (Gntext - i < (unsigned long) dc.nlines)
+				fatal_error("Corrupt delta");
+			i += dc.nlines;
+		}
+	}
+}
+
 static void escape_string(register char const *s)
 {
 	register char c;
@@ -486,12 +785,13 @@ static void keyreplace(enum markers marker)
 	char const *xxp;
 	char *leader = NULL;
 	char date_string[25];
+	struct tm tm;
 	uchar *kdelim_ptr = NULL;
 	enum expand_mode exp = Gexpand;
 	char const *sp = Keyword[(int)marker];
 
 	strftime(date_string, 25,
-		"%Y/%m/%d %H:%M:%S", localtime(&Gversion->date));
+		"%Y/%m/%d %H:%M:%S", localtime_r(&Gversion->date, &tm));
 
 	if (exp != EXPANDKV)
 		out_printf("%c%s", KDELIM, sp);
@@ -754,116 +1054,1126 @@ static int expandline(void)
 	return r + e;
 }
 
-static void process_delta(Node *node, enum stringwork func)
+/* Move the gap so that it starts before line N */
+static void merge_move_gap(unsigned long n)
 {
-	long editline = 0, linecnt = 0, adjust = 0;
-	int editor_command;
+	if (n < Ggap)
+		memmove(Gline+n+Ggapsize, Gline+n, (Ggap-n) * sizeof(uchar *));
+	else if (Ggap < n)
+		memmove(Gline+Ggap, Gline+Ggap+Ggapsize, (n-Ggap) * sizeof(uchar *));
+	Ggap = n;
+}
+
+/* Make room in the gap for at least N more lines */
+static void merge_reserve(unsigned long n)
+{
+	size_t linemax = Glinemax ? Glinemax : 1024;
+	size_t after = Glinemax - Ggap - Ggapsize;
+	if (n <= Ggapsize)
+		return;
+	while (linemax - (Glinemax - Ggapsize) < n)
+		linemax <<= 1;
+	Gline = xrealloc(Gline, sizeof(uchar *) * linemax);
+	memmove(Gline + linemax - after, Gline + Ggap + Ggapsize,
+		after * sizeof(uchar *));
+	Ggapsize += linemax - Glinemax;
+	Glinemax = linemax;
+}
+
+/*
+ * Apply a whole delta in one pass.  The edit commands are sorted and
+ * do not overlap, so the new revision is a merge of the old lines with
+ * the inserted ones.  The merge runs in place across the gap: lines
+ * before it are final, lines after it are old lines still to be
+ * merged, and each command carries the gap forward to its position
+ * and then drops or adds its whole run of lines at once.
+ */
+static void merge_delta(void)
+{
+	unsigned long at, c;
+	long adjust = 0;
+	struct editcmd *cmd;
+
+	for (c = 0; c < Gncmd; c++) {
+		cmd = &Gcmd[c];
+		if (cmd->add) {
+			at = cmd->line1 + adjust;
+			if (at > Glinemax - Ggapsize)
+				fatal_error("edit script tried to insert beyond eof");
+			merge_move_gap(at);
+			merge_reserve(cmd->nlines);
+			memcpy(Gline + Ggap, Gtext + cmd->text,
+			       cmd->nlines * sizeof(uchar *));
+			Ggap += cmd->nlines;
+			Ggapsize -= cmd->nlines;
+			adjust += cmd->nlines;
+		} else {
+			at = cmd->line1 - 1 + adjust;
+			if (Glinemax - Ggapsize < at + cmd->nlines  ||
+			    at + cmd->nlines < at)
+				fatal_error("edit script tried to delete beyond eof");
+			merge_move_gap(at);
+			Ggapsize += cmd->nlines;
+			adjust -= cmd->nlines;
+		}
+	}
+}
+
+/* Append all of Gtext to the lines in the gap buffer */
+static void merge_append(void)
+{
+	merge_move_gap(Glinemax - Ggapsize);
+	merge_reserve(Gntext);
+	memcpy(Gline + Ggap, Gtext, Gntext * sizeof(uchar *));
+	Ggap += Gntext;
+	Ggapsize -= Gntext;
+}
+
+/* Apply Gcmd one command at a time, to the gap buffer or the rope */
+static void apply_delta(void)
+{
+	unsigned long c, i;
+	long adjust = 0;
+	struct editcmd *cmd;
+
+	for (c = 0; c < Gncmd; c++) {
+		cmd = &Gcmd[c];
+		if (cmd->add) {
+			if (line_store == LineStoreRope)
+				rope_insert(cmd->line1 + adjust,
+					    Gtext + cmd->text, cmd->nlines);
+			else
+				for (i = 0; i < (unsigned long) cmd->nlines; i++)
+					insertline(cmd->line1 + adjust + i,
+						   Gtext[cmd->text + i]);
+			adjust += cmd->nlines;
+		} else {
+			if (line_store == LineStoreRope)
+				rope_delete(cmd->line1 - 1 + adjust, cmd->nlines);
+			else
+				deletelines(cmd->line1 - 1 + adjust, cmd->nlines);
+			adjust -= cmd->nlines;
+		}
+	}
+}
+
+/* Number of lines in the LEN bytes at P, a last partial one included */
+static unsigned long count_lines(uchar *p, size_t len)
+{
+	uchar *end = p + len, *nl;
+	unsigned long n = 0;
+
+	while (p < end) {
+		n++;
+		if (!(nl = memchr(p, '\n', end - p)))
+			break;
+		p = nl + 1;
+	}
+	return n;
+}
+
+/* Length of the first N lines of the LEN bytes at P, -1 if fewer */
+static size_t skip_lines(uchar *p, size_t len, unsigned long n)
+{
+	uchar *start = p, *end = p + len, *nl;
+
+	while (n--) {
+		if (p == end)
+			return (size_t) -1;
+		nl = memchr(p, '\n', end - p);
+		p = nl ? nl + 1 : end;
+	}
+	return p - start;
+}
+
+static void piece_append(struct piece **pieces, size_t *n, size_t *max,
+			 uchar *text, size_t len, unsigned long nlines)
+{
+	struct piece *last = *n ? &(*pieces)[*n - 1] : NULL;
+
+	if (!nlines)
+		return;
+	if (last && last->text + last->len == text) {
+		last->len += len;
+		last->nlines += nlines;
+		return;
+	}
+	if (*n == *max) {
+		*max = *max ? *max << 1 : 64;
+		*pieces = xrealloc(*pieces, sizeof(struct piece) * *max);
+	}
+	(*pieces)[*n].text = text;
+	(*pieces)[*n].len = len;
+	(*pieces)[*n].nlines = nlines;
+	(*n)++;
+}
+
+/*
+ * Index of the first of the N PIECES from line AT on, splitting the
+ * piece AT falls inside.
+ */
+static size_t piece_split(struct piece **pieces, size_t *n, size_t *max,
+			  unsigned long at)
+{
+	struct piece *p;
+	size_t j, b;
+
+	for (j = 0; j < *n && at >= (*pieces)[j].nlines; j++)
+		at -= (*pieces)[j].nlines;
+	if (!at)
+		return j;
+	if (*n == *max) {
+		*max <<= 1;
+		*pieces = xrealloc(*pieces, sizeof(struct piece) * *max);
+	}
+	p = *pieces;
+	memmove(&p[j + 2], &p[j + 1], sizeof(struct piece) * (*n - j - 1));
+	b = skip_lines(p[j].text, p[j].len, at);
+	p[j + 1].text = p[j].text + b;
+	p[j + 1].len = p[j].len - b;
+	p[j + 1].nlines = p[j].nlines - at;
+	p[j].len = b;
+	p[j].nlines = at;
+	(*n)++;
+	return j + 1;
+}
+
+/*
+ * Apply the deltatext of LEN bytes at TEXT to the pieces of a binary
+ * file.  Like merge_delta, the old pieces are walked once in step with
+ * the sorted commands, and only the pieces an edit lands in are split,
+ * scanning for the newline it lands on.
+ */
+static void binary_delta(uchar *text, size_t len, enum stringwork func)
+{
+	struct piece *old = Gpiece, *new = NULL;
+	size_t nold = Gnpiece, nnew = 0, newmax = 0, i = 0, off = 0, b, j;
+	unsigned long line = 0, pos = 0, k, rest;
+	long at, adjust = 0;
 	struct diffcmd dc;
-	uchar *ptr;
+	uchar *p, *end, *nl;
+	int add;
+
+	if (len < 2 || *text != SDELIM)
+		fatal_error("Illegal buffer, missing @ %s", text);
+	p = text + 1;
+	end = text + len - 1;
+	if (func == ENTER) {
+		piece_append(&new, &nnew, &newmax, p, end - p,
+			     count_lines(p, end - p));
+		goto done;
+	}
+
+	dc.dafter = dc.adprev = 0;
+	while (p < end) {
+		add = parse_command(p, &dc);
+		if (!(nl = memchr(p, '\n', end - p)))
+			fatal_error("Corrupt delta");
+		p = nl + 1;
+
+		/*
+		 * An add inside the run just deleted, as in "d2 2" then
+		 * "a2 1", copies nothing.  As in merge_delta, its lines go
+		 * in at line1 of the new lines so far, ADJUST being how
+		 * many more of those there are than old lines passed.
+		 */
+		if (add && (unsigned long) dc.line1 < pos) {
+			at = dc.line1 + adjust;
+			if (at < 0)
+				fatal_error("edit script tried to insert beyond eof");
+			j = piece_split(&new, &nnew, &newmax, at);
+			b = skip_lines(p, end - p, dc.nlines);
+			if (b == (size_t) -1)
+				fatal_error("Corrupt delta");
+			if (nnew == newmax) {
+				newmax <<= 1;
+				new = xrealloc(new, sizeof(struct piece) * newmax);
+			}
+			memmove(&new[j + 1], &new[j], sizeof(struct piece) * (nnew - j));
+			new[j].text = p;
+			new[j].len = b;
+			new[j].nlines = dc.nlines;
+			nnew++;
+			p += b;
+			adjust += dc.nlines;
+			continue;
+		}
+
+		/* copy the old lines before the command, then drop or add */
+		for (k = (add ? dc.line1 : dc.line1 - 1) - pos; k; k -= rest) {
+			if (i == nold)
+				fatal_error("edit script tried to %s beyond eof",
+					    add ? "insert" : "delete");
+			rest = old[i].nlines - line;
+			if (k < rest) {
+				b = skip_lines(old[i].text + off,
+					       old[i].len - off, k);
+				piece_append(&new, &nnew, &newmax,
+					     old[i].text + off, b, k);
+				off += b;
+				line += k;
+				break;
+			}
+			piece_append(&new, &nnew, &newmax,
+				     old[i].text + off, old[i].len - off, rest);
+			i++;
+			off = line = 0;
+		}
+		if (add) {
+			b = skip_lines(p, end - p, dc.nlines);
+			if (b == (size_t) -1)
+				fatal_error("Corrupt delta");
+			piece_append(&new, &nnew, &newmax, p, b, dc.nlines);
+			p += b;
+			pos = dc.line1;
+			adjust += dc.nlines;
+			continue;
+		}
+		for (k = dc.nlines; k; k -= rest) {
+			if (i == nold)
+				fatal_error("edit script tried to delete beyond eof");
+			rest = old[i].nlines - line;
+			if (k < rest) {
+				off += skip_lines(old[i].text + off,
+						  old[i].len - off, k);
+				line += k;
+				break;
+			}
+			i++;
+			off = line = 0;
+		}
+		pos = dc.line1 - 1 + dc.nlines;
+		adjust -= dc.nlines;
+	}
+	for (; i < nold; i++, off = line = 0)
+		piece_append(&new, &nnew, &newmax, old[i].text + off,
+			     old[i].len - off, old[i].nlines - line);
+done:
+	free(old);
+	Gpiece = new;
+	Gnpiece = nnew;
+	Gpiecemax = newmax;
+}
+
+static void process_delta(Node *node, enum stringwork func)
+{
+	unsigned long i;
 
 	Glog = node->p->log;
-	in_buffer_init((uchar *)node->p->text, 1);
 	Gversion = node->v;
 	cvs_number_string(&Gversion->number, Gversion_number);
 
+	if (Gbinary) {
+		binary_delta((uchar *)node->p->text, node->p->textlen, func);
+		return;
+	}
+	index_text((uchar *)node->p->text, node->p->textlen);
 	switch (func) {
 	case ENTER:
-		while( (ptr=in_get_line()) )
-			insertline(editline++, ptr);
-	case EDIT:
-		dc.dafter = dc.adprev = 0;
-		while ((editor_command = parse_next_delta_command(&dc)) >= 0) {
-			if (editor_command) {
-				editline = dc.line1 + adjust;
-				linecnt = dc.nlines;
-				while(linecnt--)
-					insertline(editline++, in_get_line());
-				adjust += dc.nlines;
-			} else {
-				deletelines(dc.line1 - 1 + adjust, dc.nlines);
-				adjust -= dc.nlines;
-			}
+		/* the head revision is all text, no commands */
+		if (line_store == LineStoreRope) {
+			rope_insert(0, Gtext, Gntext);
+		} else if (line_store == LineStoreMerge) {
+			merge_append();
+		} else {
+			for (i = 0; i < Gntext; i++)
+				insertline(i, Gtext[i]);
 		}
 		break;
+	case EDIT:
+		index_delta();
+		if (line_store == LineStoreMerge)
+			merge_delta();
+		else
+			apply_delta();
+		break;
 	}
 }
 
-static void finishedit(void)
+/* Call FN on each line of the current edit buffer in order */
+static void walklines(void (*fn)(uchar *))
 {
 	uchar **p, **lim, **l = Gline;
-	for (p=l, lim=l+Ggap;  p<lim;  ) {
-		in_buffer_init(*p++, 0);
-		expandline();
+	if (line_store == LineStoreRope) {
+		rope_walk(Grope, fn);
+		return;
 	}
-	for (p+=Ggapsize, lim=l+Glinemax;  p<lim;  ) {
-		in_buffer_init(*p++, 0);
-		expandline();
+	for (p=l, lim=l+Ggap;  p<lim;  )
+		fn(*p++);
+	for (p+=Ggapsize, lim=l+Glinemax;  p<lim;  )
+		fn(*p++);
+}
+
+/*
+ * Most lines hold neither an @ nor a $ (nor a NUL), and those are
+ * copied whole; strcspn finds out which without a loop of our own.
+ */
+static void finishline(uchar *l)
+{
+	size_t n = strcspn((char *)l, "\n@$");
+	if (l[n] == '\n') {
+		out_awrite((char *)l, n + 1);
+		return;
 	}
+	in_buffer_init(l, 0);
+	expandline();
 }
 
-static void snapshotline(register uchar * l)
+static void add_slice(uchar *p, size_t len)
 {
-	register int c;
-	do {
-		if ((c = *l++) == SDELIM  &&  *l++ != SDELIM)
+	struct iovec *v = Gniov ? &Giov[Gniov-1] : NULL;
+	char *s;
+
+	Giovlen += len;
+	if (len < SLICE_COPY) {
+		if (Gstageused + len > STAGE_CHUNK) {
+			if (++Gstagecur == Gnstage) {
+				Gstage = xrealloc(Gstage, sizeof(char *) * ++Gnstage);
+				Gstage[Gstagecur] = xmalloc(STAGE_CHUNK);
+			}
+			Gstageused = 0;
+			Gstagerun = false;
+		}
+		s = Gstage[Gstagecur] + Gstageused;
+		memcpy(s, p, len);
+		Gstageused += len;
+		if (Gstagerun) {
+			v->iov_len += len;
 			return;
-		out_putc(c);
-	} while (c != '\n');
+		}
+		p = (uchar *) s;
+		Gstagerun = true;
+	} else if (v && !Gstagerun && (uchar *) v->iov_base + v->iov_len == p) {
+		v->iov_len += len;
+		return;
+	} else {
+		Gstagerun = false;
+	}
+	if (Gniov == Giovmax) {
+		Giovmax = Giovmax ? Giovmax << 1 : 1024;
+		Giov = xrealloc(Giov, sizeof(struct iovec) * Giovmax);
+	}
+	Giov[Gniov].iov_base = p;
+	Giov[Gniov].iov_len = len;
+	Gniov++;
+}
 
+/* Add line L to Giov, leaving out the second @ of each @@ */
+static void sliceline(uchar *l)
+{
+	size_t n;
+	for (;;) {
+		n = strcspn((char *)l, "\n@");
+		switch (l[n]) {
+		case '\n':
+			add_slice(l, n + 1);
+			return;
+		case SDELIM:
+			if (l[n+1] != SDELIM) {
+				add_slice(l, n);
+				return;
+			}
+			add_slice(l, n + 1);
+			l += n + 2;
+			break;
+		default:	/* a NUL in the text */
+			add_slice(l, n + 1);
+			l += n + 1;
+			break;
+		}
+	}
 }
 
-static void snapshotedit(void)
+/* Add the pieces of a binary revision to Giov, undoubling @s */
+static void slicepieces(void)
 {
-	uchar **p, **lim, **l=Gline;
-	for (p=l, lim=l+Ggap;  p<lim;  )
-		snapshotline(*p++);
-	for (p+=Ggapsize, lim=l+Glinemax;  p<lim;  )
-		snapshotline(*p++);
+	uchar *p, *end, *at;
+	size_t i;
+
+	for (i = 0; i < Gnpiece; i++) {
+		p = Gpiece[i].text;
+		end = p + Gpiece[i].len;
+		while ((at = memchr(p, SDELIM, end - p))) {
+			add_slice(p, at + 1 - p);
+			p = at + 2;
+		}
+		if (p < end)
+			add_slice(p, end - p);
+	}
+}
+
+/* Whether any revision of CVS can hold a keyword, i.e. a $ */
+static bool has_keywords(cvs_file *cvs)
+{
+	cvs_patch *p;
+	for (p = cvs->patches; p; p = p->next)
+		if (p->text && memchr(p->text, KDELIM, p->textlen))
+			return true;
+	return false;
+}
+
+/* Make TO a copy of the line state FROM that can be edited on its own */
+static void copy_level(struct level *to, struct level *from)
+{
+	*to = *from;
+	if (Gbinary) {
+		to->piece = xmalloc(sizeof(struct piece) * from->piecemax);
+		memcpy(to->piece, from->piece,
+		       sizeof(struct piece) * from->npiece);
+	} else if (line_store == LineStoreRope) {
+		to->rope = rope_copy(from->rope);
+	} else {
+		to->line = xmalloc(sizeof(uchar *) * from->linemax);
+		memcpy(to->line, from->line, sizeof(uchar *) * from->linemax);
+	}
+	if (from->offset) {
+		to->offset = xmalloc(sizeof(unsigned long) * from->offsetmax);
+		memcpy(to->offset, from->offset,
+		       sizeof(unsigned long) * from->noffset);
+	}
 }
 
 static void enter_branch(Node *node)
 {
-	uchar **p = xmalloc(sizeof(uchar *) * stack[depth].linemax);
-	memcpy(p, stack[depth].line, sizeof(uchar *) * stack[depth].linemax);
-	stack[depth + 1] = stack[depth];
+	copy_level(&stack[depth + 1], &stack[depth]);
 	stack[depth + 1].next_branch = node->sib;
-	stack[depth + 1].line = p;
 	depth++;
 }
 
-void generate_files(cvs_file *cvs, void (*hook)(Node *node, void *buf, unsigned long len))
+/*
+ * With --annotate, every line pointer is mapped to the revision that
+ * brought the line in.  A line of a branch delta is new in that
+ * branch revision.  A line of the trunk is new in the oldest trunk
+ * revision that still has it, which annotate_trunk finds by running
+ * down the trunk once before anything is generated: the lines a trunk
+ * delta deletes are new in the revision it is applied to, and those
+ * left at the bottom are new in the first revision.  Each pointer
+ * gets exactly one entry, naming the revision with a string made
+ * once, and the entries are sorted by pointer; the lines of a revision
+ * mostly come in runs from one deltatext, so the entry after the last
+ * one found is tried before searching.
+ */
+struct origin {
+	uchar *line;
+	char *rev;
+};
+static struct origin *Gorigin;
+static unsigned long Gnorigin, Goriginmax;
+static char **Grevs;
+static int Gnrevs, Grevsmax;
+static __thread unsigned long Gorigincur;
+static __thread char *Grunrev;
+static __thread unsigned long Grunlen;
+
+static char *origin_rev(Node *node)
+{
+	char rev[CVS_MAX_REV_LEN];
+
+	if (Gnrevs == Grevsmax) {
+		Grevsmax = Grevsmax ? Grevsmax << 1 : 64;
+		Grevs = xrealloc(Grevs, sizeof(char *) * Grevsmax);
+	}
+	return Grevs[Gnrevs++] = strdup(cvs_number_string(&node->number, rev));
+}
+
+static void origin_add(uchar *l, char *rev)
+{
+	if (Gnorigin == Goriginmax) {
+		Goriginmax = Goriginmax ? Goriginmax << 1 : 1024;
+		Gorigin = xrealloc(Gorigin, sizeof(struct origin) * Goriginmax);
+	}
+	Gorigin[Gnorigin].line = l;
+	Gorigin[Gnorigin++].rev = rev;
+}
+
+static int compare_origin(const void *a, const void *b)
+{
+	uchar *la = ((const struct origin *)a)->line;
+	uchar *lb = ((const struct origin *)b)->line;
+
+	return la < lb ? -1 : la > lb;
+}
+
+static char *origin_get(uchar *l)
 {
-	int expandflag = Gexpand < EXPANDKO;
-	Node *node = head_node;
+	unsigned long lo = 0, hi = Gnorigin, mid;
+
+	if (++Gorigincur < Gnorigin && Gorigin[Gorigincur].line == l)
+		return Gorigin[Gorigincur].rev;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (Gorigin[mid].line < l)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == Gnorigin || Gorigin[lo].line != l)
+		return NULL;
+	Gorigincur = lo;
+	return Gorigin[lo].rev;
+}
+
+static void annotate_trunk(void)
+{
+	Node *node, *next;
+	struct editcmd *cmd;
+	unsigned long c, i, k;
+	char *rev;
+
 	depth = 0;
-	Gfilename = cvs->name;
-	if (!suppress_keyword_expansion && cvs->expand)
-	    Gexpand = expand_override(cvs->expand);
+	memset(&stack[0], 0, sizeof(stack[0]));
+	index_text((uchar *)head_node->p->text, head_node->p->textlen);
+	merge_append();
+	for (node = head_node; (next = node->to); node = next) {
+		index_text((uchar *)next->p->text, next->p->textlen);
+		index_delta();
+		rev = origin_rev(node);
+		for (c = 0; c < Gncmd; c++) {
+			cmd = &Gcmd[c];
+			if (cmd->add)
+				continue;
+			for (i = 0; i < (unsigned long) cmd->nlines; i++) {
+				k = cmd->line1 - 1 + i;
+				if (k >= Glinemax - Ggapsize)
+					break;
+				if (k >= Ggap)
+					k += Ggapsize;
+				origin_add(Gline[k], rev);
+			}
+		}
+		merge_delta();
+	}
+	rev = origin_rev(node);
+	for (i = 0; i < Glinemax; i++)
+		if (i < Ggap || i >= Ggap + Ggapsize)
+			origin_add(Gline[i], rev);
+	free(stack[0].line);
+	memset(&stack[0], 0, sizeof(stack[0]));
+}
+
+/* The lines added by the branch deltas from NODE on are new in their revision */
+static void annotate_branches(Node *node, bool trunk)
+{
+	Node *branch;
+	unsigned long c, i;
+	char *rev;
+
+	for (; node; node = node->to) {
+		if (!trunk) {
+			index_text((uchar *)node->p->text, node->p->textlen);
+			index_delta();
+			rev = origin_rev(node);
+			for (c = 0; c < Gncmd; c++)
+				if (Gcmd[c].add)
+					for (i = 0; i < (unsigned long) Gcmd[c].nlines; i++)
+						origin_add(Gtext[Gcmd[c].text + i], rev);
+		}
+		for (branch = node->down; branch; branch = branch->sib)
+			annotate_branches(branch, false);
+	}
+}
+
+static void annotate_setup(void)
+{
+	annotate_trunk();
+	annotate_branches(head_node, true);
+	qsort(Gorigin, Gnorigin, sizeof(struct origin), compare_origin);
+}
+
+static void annotate_cleanup(void)
+{
+	while (Gnrevs)
+		free(Grevs[--Gnrevs]);
+	free(Grevs);
+	Grevs = NULL;
+	Grevsmax = 0;
+	free(Gorigin);
+	Gorigin = NULL;
+	Gnorigin = Goriginmax = 0;
+}
+
+/* Write out the run of lines from Grunrev, by hand as there may be millions */
+static void annotate_flush(void)
+{
+	char field[CVS_MAX_REV_LEN + 32], *p = field + sizeof(field);
+	unsigned long n = Grunlen;
+	size_t len;
+
+	if (!n)
+		return;
+	do
+		*--p = '0' + n % 10;
+	while ((n /= 10));
+	*--p = ':';
+	len = strlen(Grunrev);
+	p -= len;
+	memcpy(p, Grunrev, len);
+	*--p = ' ';
+	fwrite(p, 1, field + sizeof(field) - p, annotate_file);
+	Grunlen = 0;
+}
+
+static void annotate_line(uchar *l)
+{
+	char *rev = origin_get(l);
+
+	if (!rev)
+		fatal_error("line with no origin");
+	if (rev != Grunrev)
+		annotate_flush();
+	Grunrev = rev;
+	Grunlen++;
+}
+
+/* Write the origin of each line of NODE as runs of lines */
+static void annotate_revision(Node *node)
+{
+	char rev[CVS_MAX_REV_LEN];
+
+	fprintf(annotate_file, "%s %s", Gfilename,
+		cvs_number_string(&node->number, rev));
+	Grunrev = NULL;
+	Grunlen = 0;
+	Gorigincur = 0;
+	walklines(annotate_line);
+	annotate_flush();
+	putc('\n', annotate_file);
+}
+
+/* Per file settings, shared by all threads */
+static bool Gkeywords;
+static bool Gannotate;
+static void (*Ghook)(Node *node, struct iovec *iov, int iovcnt, unsigned long len);
+
+/*
+ * With --threads, a large file's branches are queued as jobs, each
+ * with its own copy of the lines at the branch point.  A revision
+ * whose turn has come in depth-first order goes to Ghook straight
+ * from the buffers of the thread that made it.  One made early is
+ * copied and kept on its Node until its turn, but only while fewer
+ * than DEFER_MAX are kept; past that, the thread waits for its turn.
+ * Jobs are taken in the order they are queued, which is the order
+ * their revisions go out, so the revision next in turn is always
+ * being made by a thread that is not waiting.
+ */
+#define THREAD_MIN_TEXT (1 << 20)
+#define DEFER_MAX 32
+struct job {
+	struct job *next;
+	Node *node;
+	struct level level;
+};
+static bool Gdefer;
+static __thread int Gslot;
+static struct job *Gjobs, **Gjobtail = &Gjobs;
+static bool Gjobsdone;
+static Node **Gorder;
+static int Gnorder, Gordermax, Gemitted, Gwaiting;
+static pthread_mutex_t Glock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Gjobready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t Gturn = PTHREAD_COND_INITIALIZER;
+
+/* Hand out the revisions that are next in order, Glock held */
+static void emit_ready(void)
+{
+	struct iovec iov;
+	Node *node;
+
+	while (Gemitted < Gnorder && Gorder[Gemitted]->blobready) {
+		node = Gorder[Gemitted++];
+		iov.iov_base = node->blob;
+		iov.iov_len = node->bloblen;
+		Ghook(node, &iov, 1, node->bloblen);
+		free(node->blob);
+		node->blob = NULL;
+		Gwaiting--;
+		pthread_cond_broadcast(&Gturn);
+	}
+}
+
+/* Whether it is NODE's turn, waiting for it while too many revisions wait */
+static bool defer_turn(Node *node)
+{
+	bool turn;
+
+	pthread_mutex_lock(&Glock);
+	while (Gorder[Gemitted] != node && Gwaiting >= DEFER_MAX)
+		pthread_cond_wait(&Gturn, &Glock);
+	turn = Gorder[Gemitted] == node;
+	pthread_mutex_unlock(&Glock);
+	return turn;
+}
+
+/* Whether line L holds a $, leaving aside the @ that may end it */
+static bool keyline(uchar *l)
+{
+	size_t n;
+	for (;;) {
+		n = strcspn((char *)l, "\n@$");
+		switch (l[n]) {
+		case KDELIM:
+			return true;
+		case SDELIM:
+			if (l[n+1] != SDELIM)
+				return false;
+			l += n + 2;
+			break;
+		case '\n':
+			return false;
+		default:	/* a NUL in the text */
+			l += n + 1;
+			break;
+		}
+	}
+}
+
+static void offset_add(unsigned long offset)
+{
+	if (Gnoffset == Goffsetmax) {
+		Goffsetmax = Goffsetmax ? Goffsetmax << 1 : 1024;
+		Goffset = xrealloc(Goffset, sizeof(unsigned long) * Goffsetmax);
+	}
+	Goffset[Gnoffset++] = offset;
+}
+
+/* Put out line L as finishline or sliceline would, noting where it starts */
+static void offsetline(uchar *l)
+{
+	if (!Gkeywords) {
+		offset_add(Giovlen);
+		sliceline(l);
+		return;
+	}
+	if (Gnoffset == Gkeylinemax) {
+		Gkeylinemax = Gkeylinemax ? Gkeylinemax << 1 : 1024;
+		Gkeyline = xrealloc(Gkeyline, sizeof(bool) * Gkeylinemax);
+	}
+	Gkeyline[Gnoffset] = keyline(l);
+	offset_add(out_buffer_count());
+	finishline(l);
+}
+
+static void delta_put(const void *p, size_t n)
+{
+	if (Gdeltalen + n > Gdeltamax) {
+		Gdeltamax = max(Gdeltamax << 1, Gdeltalen + n);
+		Gdelta = xrealloc(Gdelta, Gdeltamax);
+	}
+	memcpy(Gdelta + Gdeltalen, p, n);
+	Gdeltalen += n;
+}
+
+static void delta_size(unsigned long v)
+{
+	uchar c;
+	for (;;) {
+		c = v & 0x7f;
+		v >>= 7;
+		if (!v)
+			break;
+		c |= 0x80;
+		delta_put(&c, 1);
+	}
+	delta_put(&c, 1);
+}
+
+/* A git delta copy: a flag byte says which bytes of each number follow */
+static void delta_copy(unsigned long off, unsigned long len)
+{
+	uchar op[8];
+	unsigned long n;
+	int i, k;
+
+	while (len) {
+		n = min(len, 0xffffff);
+		op[0] = 0x80;
+		k = 1;
+		for (i = 0; i < 4; i++)
+			if ((off >> (8 * i)) & 0xff) {
+				op[0] |= 1 << i;
+				op[k++] = off >> (8 * i);
+			}
+		for (i = 0; i < 3; i++)
+			if ((n >> (8 * i)) & 0xff) {
+				op[0] |= 0x10 << i;
+				op[k++] = n >> (8 * i);
+			}
+		delta_put(op, k);
+		off += n;
+		len -= n;
+	}
+}
+
+/* Insert bytes FROM up to TO of the revision in IOV, 127 at most a time */
+static void delta_insert(struct iovec *iov, unsigned long from, unsigned long to)
+{
+	size_t skip, n;
+	uchar op;
+
+	while (from < to) {
+		op = min(to - from, 127);
+		delta_put(&op, 1);
+		while (op) {
+			while (Gdeltaiovstart + iov[Gdeltaiov].iov_len <= from)
+				Gdeltaiovstart += iov[Gdeltaiov++].iov_len;
+			skip = from - Gdeltaiovstart;
+			n = min(iov[Gdeltaiov].iov_len - skip, op);
+			delta_put((char *)iov[Gdeltaiov].iov_base + skip, n);
+			from += n;
+			op -= n;
+		}
+	}
+}
+
+/*
+ * Copy the COUNT lines the delta keeps, line B of the old revision
+ * and line N of the new one, inserting any with a $ in them instead.
+ * A run of kept lines must come out the same length in both, or the
+ * offsets are not what they seem and there is no delta.
+ */
+static bool delta_keep(struct iovec *iov, unsigned long b, unsigned long n,
+		       unsigned long count)
+{
+	unsigned long *old = stack[depth].offset, i, start, len;
+
+	for (i = start = 0; i <= count; i++) {
+		if (i < count && !(Gkeywords && Gkeyline[n + i]))
+			continue;
+		len = old[b + i] - old[b + start];
+		if (len != Goffset[n + i] - Goffset[n + start])
+			return false;
+		if (len)
+			delta_copy(old[b + start], len);
+		if (i < count)
+			delta_insert(iov, Goffset[n + i], Goffset[n + i + 1]);
+		start = i + 1;
+	}
+	return true;
+}
+
+/* Turn the edit commands of the current delta into Gdelta */
+static bool make_delta(struct iovec *iov)
+{
+	unsigned long nold = stack[depth].noffset - 1;
+	unsigned long b = 0, n = 0, keep, c;
+	struct editcmd *cmd;
+
+	/* copies can only reach the first 4GB of the old revision */
+	if (stack[depth].offset[nold] > 0xffffffffUL)
+		return false;
+	Gdeltalen = 0;
+	Gdeltaiov = 0;
+	Gdeltaiovstart = 0;
+	delta_size(stack[depth].offset[nold]);
+	delta_size(Goffset[Gnoffset - 1]);
+	for (c = 0; ; c++) {
+		cmd = c < Gncmd ? &Gcmd[c] : NULL;
+		if (!cmd)
+			keep = nold - b;
+		else if (cmd->line1 < b + !cmd->add || cmd->line1 > nold)
+			/* an add inside the run just deleted, as in "d2 2" then "a2 1" */
+			return false;
+		else
+			keep = cmd->line1 - (cmd->add ? 0 : 1) - b;
+		if (!delta_keep(iov, b, n, keep))
+			return false;
+		b += keep;
+		n += keep;
+		if (!cmd)
+			break;
+		if (cmd->add) {
+			delta_insert(iov, Goffset[n], Goffset[n + cmd->nlines]);
+			n += cmd->nlines;
+		} else {
+			b += cmd->nlines;
+		}
+	}
+	return n == Gnoffset - 1;
+}
+
+/*
+ * Make the delta of NODE's revision, LEN bytes in IOV, against the
+ * revision before it, and keep the offsets of its lines for the next.
+ */
+static void delta_revision(Node *node, struct iovec *iov, unsigned long len)
+{
+	struct level *l = &stack[depth];
+	unsigned long *offset = l->offset;
+	size_t offsetmax = l->offsetmax;
+
+	offset_add(len);
+	Gdeltaready = Gdeltabase && make_delta(iov);
+	l->offset = Goffset;
+	l->noffset = Gnoffset;
+	l->offsetmax = Goffsetmax;
+	l->emitted = node;
+	Goffset = offset;
+	Goffsetmax = offset ? offsetmax : 0;
+	Gnoffset = 0;
+}
+
+/*
+ * The delta of the revision being handed to the hook, if there is
+ * one, in *LEN bytes, and in *BASE the revision it applies to.
+ */
+char *generate_delta(Node **base, unsigned long *len)
+{
+	if (!Gdeltaready)
+		return NULL;
+	*base = Gdeltabase;
+	*len = Gdeltalen;
+	return (char *)Gdelta;
+}
+
+/* Fill Giov with the slices of the current revision, if it is verbatim */
+static void slicerevision(void)
+{
+	Gniov = 0;
+	Giovlen = 0;
+	Gstagecur = -1;
+	Gstageused = STAGE_CHUNK;
+	Gstagerun = false;
+	Gnoffset = 0;
+	if (Gbinary)
+		slicepieces();
 	else
-	    Gexpand = EXPANDKK;
-	Gabspath = NULL;
-	Gline = NULL; Ggap = Ggapsize = Glinemax = 0;
+		walklines(Gdeltas && !Gdefer ? offsetline : sliceline);
+}
+
+/* The current revision as one malloced buffer of *LEN bytes */
+static char *revision_text(unsigned long *len)
+{
+	struct iovec *v;
+	char *text, *p;
+	int i;
+
+	if (Gkeywords) {
+		out_buffer_init();
+		walklines(finishline);
+		text = out_buffer_text();
+		*len = out_buffer_count();
+		free(Goutbuf);
+		return text;
+	}
+	slicerevision();
+	text = p = xmalloc(Giovlen);
+	for (i = 0, v = Giov; i < Gniov; i++, v++) {
+		memcpy(p, v->iov_base, v->iov_len);
+		p += v->iov_len;
+	}
+	*len = Giovlen;
+	return text;
+}
+
+/*
+ * The head revision is the text of its delta, so when it has no
+ * keywords to expand, export_blob may copy it from the ,v file as it
+ * is.
+ */
+static void verbatim_revision(Node *node, unsigned long len)
+{
+	if (node == head_node && node->p->textoff &&
+	    len == node->p->textlen - 2 &&
+	    (!Gkeywords || !memchr(node->p->text, KDELIM, node->p->textlen)))
+		node->textoff = node->p->textoff;
+}
+
+static void emit_revision(Node *node)
+{
+	struct iovec iov;
+
+	if (Gannotate)
+		annotate_revision(node);
+	if (Gdefer && !defer_turn(node)) {
+		node->blob = revision_text(&node->bloblen);
+		verbatim_revision(node, node->bloblen);
+		pthread_mutex_lock(&Glock);
+		node->blobready = true;
+		Gwaiting++;
+		/* its turn may have come meanwhile */
+		emit_ready();
+		pthread_mutex_unlock(&Glock);
+		return;
+	}
+	if (Gkeywords) {
+		out_buffer_init();
+		Gnoffset = 0;
+		walklines(Gdeltas ? offsetline : finishline);
+		iov.iov_base = out_buffer_text();
+		iov.iov_len = out_buffer_count();
+		verbatim_revision(node, iov.iov_len);
+		if (Gdeltas)
+			delta_revision(node, &iov, iov.iov_len);
+		Ghook(node, &iov, 1, iov.iov_len);
+		Gdeltaready = false;
+		out_buffer_cleanup();
+	} else {
+		slicerevision();
+		verbatim_revision(node, Giovlen);
+		if (Gdeltas)
+			delta_revision(node, Giov, Giovlen);
+		Ghook(node, Giov, Gniov, Giovlen);
+		Gdeltaready = false;
+	}
+	if (Gdefer) {
+		pthread_mutex_lock(&Glock);
+		Gemitted++;
+		emit_ready();
+		pthread_cond_broadcast(&Gturn);
+		pthread_mutex_unlock(&Glock);
+	}
+}
+
+static void queue_branch(Node *node)
+{
+	struct job *job = xmalloc(sizeof(struct job));
+
+	job->next = NULL;
+	job->node = node;
+	copy_level(&job->level, &stack[0]);
+	job->level.next_branch = NULL;
+	pthread_mutex_lock(&Glock);
+	*Gjobtail = job;
+	Gjobtail = &job->next;
+	pthread_cond_signal(&Gjobready);
+	pthread_mutex_unlock(&Glock);
+}
+
+/*
+ * Generate the revisions from NODE on, given the lines before its
+ * delta in stack[0].  With SPAWN, the branches leaving that line of
+ * development are queued for other threads instead of being entered.
+ */
+static void generate_tree(Node *node, enum stringwork func, bool spawn)
+{
+	Node *branch;
+
+	depth = 0;
+	Gdeltabase = func == EDIT && stack[0].emitted == stack[0].node ?
+		stack[0].node : NULL;
 	stack[0].node = node;
-	process_delta(node, ENTER);
+	process_delta(node, func);
 	while (1) {
-		if (node->file) {
-			out_buffer_init();
-			if (expandflag)
-				finishedit();
-			else
-				snapshotedit();
-			hook(node, out_buffer_text(), out_buffer_count());
-			out_buffer_cleanup();
+		if (node->file)
+			emit_revision(node);
+		if (spawn) {
+			for (branch = node->down; branch; branch = branch->sib)
+				queue_branch(branch);
+			node = NULL;
+		} else {
+			node = node->down;
 		}
-		node = node->down;
 		if (node) {
 			enter_branch(node);
 			goto Next;
 		}
 		while ((node = stack[depth].node->to) == NULL) {
 			free(stack[depth].line);
+			rope_free(stack[depth].rope);
+			free(stack[depth].piece);
+			free(stack[depth].offset);
 			if (!depth)
-				goto Done;
+				return;
 			node = stack[depth--].next_branch;
 			if (node) {
 				enter_branch(node);
@@ -871,12 +2181,340 @@ void generate_files(cvs_file *cvs, void (*hook)(Node *node, void *buf, unsigned
 			}
 		}
 Next:
+		/* the lines are those of the last revision emitted, or not */
+		Gdeltabase = stack[depth].emitted == stack[depth].node ?
+			stack[depth].node : NULL;
 		stack[depth].node = node;
 		process_delta(node, EDIT);
 	}
-Done:
+}
+
+/* Release what this thread kept from one revision to the next */
+static void generate_cleanup(void)
+{
 	free(Gkeyval);
 	Gkeyval = NULL;
 	Gkvlen = 0;
+	free(Gtext);
+	Gtext = NULL;
+	Gntext = Gtextmax = 0;
+	free(Gcmd);
+	Gcmd = NULL;
+	Gncmd = Gcmdmax = 0;
+	free(Goffset);
+	Goffset = NULL;
+	Gnoffset = Goffsetmax = 0;
+	free(Gkeyline);
+	Gkeyline = NULL;
+	Gkeylinemax = 0;
+	free(Gdelta);
+	Gdelta = NULL;
+	Gdeltalen = Gdeltamax = 0;
+	free(Giov);
+	Giov = NULL;
+	Giovmax = 0;
+	while (Gnstage)
+		free(Gstage[--Gnstage]);
+	free(Gstage);
+	Gstage = NULL;
+	rope_discard();
 	free(Gabspath);
+	Gabspath = NULL;
+}
+
+static void *generate_worker(void *arg)
+{
+	struct job *job;
+
+	if (arg)
+		Gslot = *(int *)arg;
+	for (;;) {
+		pthread_mutex_lock(&Glock);
+		while (!Gjobs && !Gjobsdone)
+			pthread_cond_wait(&Gjobready, &Glock);
+		if ((job = Gjobs) && !(Gjobs = job->next))
+			Gjobtail = &Gjobs;
+		pthread_mutex_unlock(&Glock);
+		if (!job)
+			break;
+		stack[0] = job->level;
+		generate_tree(job->node, EDIT, false);
+		free(job);
+	}
+	generate_cleanup();
+	return NULL;
+}
+
+/* Which of the threads generating a file this is, 0 for the main one */
+int generate_slot(void)
+{
+	return Gslot;
+}
+
+/* List the revisions from NODE on in the order they are generated */
+static void order_tree(Node *node)
+{
+	Node *branch;
+
+	for (; node; node = node->to) {
+		if (node->file) {
+			if (Gnorder == Gordermax) {
+				Gordermax = Gordermax ? Gordermax << 1 : 256;
+				Gorder = xrealloc(Gorder, sizeof(Node *) * Gordermax);
+			}
+			Gorder[Gnorder++] = node;
+		}
+		for (branch = node->down; branch; branch = branch->sib)
+			order_tree(branch);
+	}
+}
+
+/* Count the lines the deltatext of P adds and deletes, without applying it */
+static void delta_counts(cvs_patch *p, long *added, long *deleted)
+{
+	uchar *q, *end, *nl;
+	struct diffcmd dc;
+	size_t b;
+
+	*added = *deleted = 0;
+	if (!p)
+		return;
+	if (p->textlen < 2 || *p->text != SDELIM)
+		fatal_error("Illegal buffer, missing @ %s", p->text);
+	q = (uchar *)p->text + 1;
+	end = (uchar *)p->text + p->textlen - 1;
+	dc.dafter = dc.adprev = 0;
+	while (q < end) {
+		if (!(nl = memchr(q, '\n', end - q)))
+			fatal_error("Corrupt delta");
+		if (parse_command(q, &dc)) {
+			q = nl + 1;
+			b = skip_lines(q, end - q, dc.nlines);
+			if (b == (size_t) -1)
+				fatal_error("Corrupt delta");
+			q += b;
+			*added += dc.nlines;
+		} else {
+			q = nl + 1;
+			*deleted += dc.nlines;
+		}
+	}
+}
+
+static void diffstat_record(Node *node, long lines, long added, long removed)
+{
+	if (!node->file)
+		return;
+	node->file->lines = lines;
+	node->file->added = added;
+	node->file->removed = removed;
+}
+
+/*
+ * Work out the line counts from NODE on, NODE having LINES lines.  On
+ * the trunk a delta turns a revision into the one before it, so the
+ * churn of a revision comes from the delta of its predecessor, read
+ * backwards; on a branch it is the revision's own delta.
+ */
+static void diffstat_tree(Node *node, long lines, long added, long removed,
+			  bool trunk)
+{
+	Node *branch, *next;
+	long a, d;
+
+	for (;;) {
+		for (branch = node->down; branch; branch = branch->sib) {
+			delta_counts(branch->p, &a, &d);
+			diffstat_tree(branch, lines + a - d, a, d, false);
+		}
+		if (!(next = node->to)) {
+			if (trunk)
+				added = lines, removed = 0;
+			diffstat_record(node, lines, added, removed);
+			return;
+		}
+		delta_counts(next->p, &a, &d);
+		if (trunk)
+			diffstat_record(node, lines, d, a);
+		else
+			diffstat_record(node, lines, added, removed);
+		node = next;
+		lines += a - d;
+		added = a;
+		removed = d;
+	}
+}
+
+/*
+ * Fill in the line counts and churn of every revision of CVS straight
+ * from the edit commands, leaving the text alone.
+ */
+void generate_diffstat(cvs_file *cvs)
+{
+	cvs_patch *p;
+
+	if (!head_node || !(p = head_node->p))
+		return;
+	if (p->textlen < 2 || *p->text != SDELIM)
+		fatal_error("Illegal buffer, missing @ %s", p->text);
+	diffstat_tree(head_node, count_lines((uchar *)p->text + 1, p->textlen - 2),
+		      0, 0, true);
+}
+
+static void generate_setup(cvs_file *cvs)
+{
+	Gfilename = cvs->name;
+	if (!suppress_keyword_expansion && cvs->expand)
+	    Gexpand = expand_override(cvs->expand);
+	else
+	    Gexpand = EXPANDKK;
+	/* -ko and -kb files, and files without a $, are copied verbatim */
+	Gkeywords = Gexpand < EXPANDKO && has_keywords(cvs);
+	Gbinary = Gexpand == EXPANDKB;
+	Gdeltas = false;
+	Gabspath = NULL;
+	depth = 0;
+	memset(&stack[0], 0, sizeof(stack[0]));
+}
+
+/* Fill PATH[N ..] with the nodes leading from NODE to TARGET */
+static int find_path(Node *node, Node *target, Node **path, int n)
+{
+	Node *branch;
+	int k;
+
+	for (; node; node = node->to) {
+		path[n++] = node;
+		if (node == target)
+			return n;
+		for (branch = node->down; branch; branch = branch->sib)
+			if ((k = find_path(branch, target, path, n)))
+				return k;
+	}
+	return 0;
+}
+
+/*
+ * Return revision NUMBER of CVS in a malloced buffer of *LEN bytes,
+ * or NULL if there is no such revision.  Only the deltas between the
+ * head and that revision are applied.  The branches of CVS must have
+ * been built.
+ */
+char *generate_revision(cvs_file *cvs, cvs_number *number, unsigned long *len)
+{
+	cvs_version *v;
+	cvs_patch *p;
+	Node **path, *target = NULL;
+	char *text;
+	int i, n = 0;
+
+	for (v = cvs->versions; v; v = v->next)
+		if (cvs_number_compare(&v->number, number) == 0)
+			target = v->node;
+	if (!target || !target->p || !head_node)
+		return NULL;
+	for (p = cvs->patches; p; p = p->next)
+		n++;
+	path = xmalloc(sizeof(Node *) * n);
+	n = find_path(head_node, target, path, 0);
+
+	text = NULL;
+	if (n) {
+		generate_setup(cvs);
+		process_delta(path[0], ENTER);
+		for (i = 1; i < n; i++)
+			process_delta(path[i], EDIT);
+		text = revision_text(len);
+		free(stack[0].line);
+		rope_free(stack[0].rope);
+		free(stack[0].piece);
+		generate_cleanup();
+	}
+	free(path);
+	return text;
+}
+
+/* Whether the revisions of CVS are worth more than one thread */
+static bool generate_threaded(cvs_file *cvs)
+{
+	size_t total = 0;
+	cvs_patch *p;
+
+	for (p = cvs->patches; p; p = p->next)
+		total += p->textlen;
+	return threads > 1 && total >= THREAD_MIN_TEXT;
+}
+
+/*
+ * Reserve the marks of the blobs of CVS as generate_files would have,
+ * for blobs handed to export_blob in some other order, as from the
+ * cache, so that they end up with the same marks.
+ */
+void generate_reserve_marks(cvs_file *cvs)
+{
+	if (!generate_threaded(cvs) || !(blob_shards || pack_repo))
+		return;
+	order_tree(head_node);
+	export_reserve_marks(Gorder, Gnorder);
+	free(Gorder);
+	Gorder = NULL;
+	Gnorder = Gordermax = 0;
+}
+
+void generate_files(cvs_file *cvs, void (*hook)(Node *node, struct iovec *iov, int iovcnt, unsigned long len))
+{
+	pthread_t *workers = NULL;
+	int *slots;
+	int i, nworkers = 0;
+
+	generate_setup(cvs);
+	Ghook = hook;
+	Gdeltas = pack_repo && !Gbinary;
+
+	/* annotate lines go out as revisions are made, so one thread only */
+	Gannotate = annotate_file && !Gbinary && head_node;
+	if (!generate_threaded(cvs) || Gannotate) {
+		Gdefer = false;
+		if (Gannotate)
+			annotate_setup();
+		generate_tree(head_node, ENTER, false);
+		generate_cleanup();
+		if (Gannotate)
+			annotate_cleanup();
+		return;
+	}
+
+	/*
+	 * Sharded blobs, and blobs going into a pack, can go out in any
+	 * order once their marks are fixed, and spooled blobs have no
+	 * marks at all, so no revision waits for its turn.
+	 */
+	order_tree(head_node);
+	Gdefer = !blob_shards && !pack_repo && !inline_blobs;
+	if (blob_shards || pack_repo)
+		export_reserve_marks(Gorder, Gnorder);
+	Gjobsdone = false;
+	workers = xmalloc(sizeof(pthread_t) * (threads - 1));
+	slots = xmalloc(sizeof(int) * (threads - 1));
+	for (i = 0; i < threads - 1; i++) {
+		slots[nworkers] = nworkers + 1;
+		if (pthread_create(&workers[nworkers], NULL,
+				   generate_worker, &slots[nworkers]) == 0)
+			nworkers++;
+	}
+	/* with no other thread, the revisions come in turn anyway */
+	generate_tree(head_node, ENTER, nworkers > 0);
+	pthread_mutex_lock(&Glock);
+	Gjobsdone = true;
+	pthread_cond_broadcast(&Gjobready);
+	pthread_mutex_unlock(&Glock);
+	generate_worker(NULL);
+	for (i = 0; i < nworkers; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+	free(slots);
+	assert(!Gdefer || Gemitted == Gnorder);
+	free(Gorder);
+	Gorder = NULL;
+	Gnorder = Gordermax = Gemitted = 0;
 }
@@ -28,6 +28,7 @@ time_t skew_vulnerable = 0;
     int		i;
     time_t	date;
     char	*s;
+    cvs_text	text;
     cvs_number	number;
     cvs_symbol	*symbol;
     cvs_version	*version;
@@ -43,10 +44,12 @@ time_t skew_vulnerable = 0;
 %token		DESC LOG TEXT STRICT AUTHOR STATE
 %token		SEMI COLON
 %token		BRAINDAMAGED_NUMBER
-%token <s>	HEX NAME DATA TEXT_DATA
+%token <s>	HEX NAME DATA
+%token <text>	TEXT_DATA
 %token <number>	NUMBER
 
-%type <s>	text log
+%type <text>	text
+%type <s>	log
 %type <symbol>	symbollist symbol symbols
 %type <version>	revision
 %type <vlist>	revisions
@@ -193,7 +196,9 @@ patch		: NUMBER log text
 		  { $$ = calloc (1, sizeof (cvs_patch));
 		    $$->number = $1;
 		    $$->log = $2;
-		    $$->text = $3;
+		    $$->text = $3.data;
+		    $$->textlen = $3.length;
+		    $$->textoff = $3.offset;
 		    hash_patch($$);
 		  }
 		;
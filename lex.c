@@ -0,0 +1,214 @@
+/* hand-written stand-in for the flex scanner, for local testing only */
+#include "cvs.h"
+#include "y.tab.h"
+FILE *yyin;
+int yylineno;
+char yytext[65536];
+enum { S_INITIAL, S_CONTENT, S_SKIP, S_COMMIT };
+static int state = S_INITIAL;
+static char *parse_data (int strip, size_t *length, off_t *offset);
+static void fast_export_sanitize(void);
+#define BEGIN(s) (state = S_##s)
+static int isnamestart(int c){return isalpha(c)||c=='-'||c=='_'||c=='+'||c=='%';}
+static int isnamechar(int c){return isalnum(c)||strchr("-_+/%.~^\\*?",c)!=NULL;}
+int yylex(void)
+{
+    int c;
+    for (;;) {
+	c = getc(yyin);
+	if (c == EOF) { state = S_INITIAL; return 0; }
+	if (c == ' ' || c == '\t' || c == '\n') { if (c=='\n') yylineno++; continue; }
+	if (c == '@') {
+	    if (state == S_SKIP) { yylval.text.data = parse_data(0, &yylval.text.length, &yylval.text.offset); BEGIN(INITIAL); return TEXT_DATA; }
+	    if (state == S_INITIAL || state == S_CONTENT) { yylval.s = parse_data(1, NULL, NULL); return DATA; }
+	}
+	if (c == ';') { BEGIN(INITIAL); return SEMI; }
+	if (c == ':') return COLON;
+	if (isdigit(c)) {
+	    int n = 0; int dot = 0;
+	    yytext[n++] = c;
+	    while ((c = getc(yyin)) != EOF && (isdigit(c) || (c=='.'))) { if (c=='.') dot=1; yytext[n++] = c; }
+	    if (state == S_COMMIT && c != EOF && isalnum(c) && !dot) {
+		while (c != EOF && isalnum(c)) { yytext[n++] = c; c = getc(yyin); }
+		ungetc(c, yyin); yytext[n] = 0;
+		yylval.s = atom(yytext); return NAME;
+	    }
+	    ungetc(c, yyin); yytext[n] = 0;
+	    if (dot) { yylval.number = lex_number(yytext); return NUMBER; }
+	    if (n == 1 && yytext[0] == '1') return BRAINDAMAGED_NUMBER;
+	    continue;
+	}
+	if (state == S_INITIAL && isalpha(c)) {
+	    static const struct { const char *k; int t; int s; } kw[] = {
+		{"head",HEAD,S_CONTENT},{"branch",BRANCH,S_CONTENT},{"access",ACCESS,S_CONTENT},
+		{"symbols",SYMBOLS,S_CONTENT},{"locks",LOCKS,S_CONTENT},{"comment",COMMENT,S_CONTENT},
+		{"expand",EXPAND,S_CONTENT},{"date",DATE,S_CONTENT},{"branches",BRANCHES,S_CONTENT},
+		{"next",NEXT,S_CONTENT},{"commitid",COMMITID,S_COMMIT},{"strict",STRICT,S_CONTENT},
+		{"author",AUTHOR,S_CONTENT},{"state",STATE,S_CONTENT},{"desc",DESC,-1},
+		{"log",LOG,-1},{"text",TEXT,S_SKIP}};
+	    int n = 0; unsigned i;
+	    yytext[n++] = c;
+	    while ((c = getc(yyin)) != EOF && isalpha(c)) yytext[n++] = c;
+	    ungetc(c, yyin); yytext[n] = 0;
+	    for (i = 0; i < sizeof kw / sizeof kw[0]; i++)
+		if (!strcmp(kw[i].k, yytext)) { if (kw[i].s >= 0) state = kw[i].s; return kw[i].t; }
+	    fprintf(stderr, "fake lexer: unknown keyword %s\n", yytext);
+	    continue;
+	}
+	if (state == S_CONTENT && isnamestart(c)) {
+	    int n = 0;
+	    yytext[n++] = c;
+	    while ((c = getc(yyin)) != EOF && isnamechar(c)) yytext[n++] = c;
+	    ungetc(c, yyin); yytext[n] = 0;
+	    fast_export_sanitize();
+	    yylval.s = atom(yytext); return NAME;
+	}
+	if (state == S_COMMIT && isalnum(c)) {
+	    int n = 0;
+	    yytext[n++] = c;
+	    while ((c = getc(yyin)) != EOF && isalnum(c)) yytext[n++] = c;
+	    ungetc(c, yyin); yytext[n] = 0;
+	    yylval.s = atom(yytext); return NAME;
+	}
+	fprintf(stderr, "%s: (%d) ignoring %c\n", yyfilename, yylineno, c);
+    }
+}
+
+
+struct varbuf {
+	int len, cur;
+	char *string;
+};
+
+static inline void addbuf(struct varbuf *buf, char c)
+{
+	if (buf->cur == buf->len) 
+		buf->string = realloc(buf->string, buf->len *= 2);
+	buf->string[buf->cur++] = c;
+}
+
+/*
+ * With OFFSET, also tell where in the file the data starts, or 0 if
+ * it held an @@, which makes it differ from what is in the file.
+ */
+static char *
+parse_data (int strip, size_t *length, off_t *offset)
+{
+    int c;
+    char *ret;
+    struct varbuf buf;
+
+    buf.cur = 0;
+    buf.len = 256;
+    buf.string = malloc(buf.len);
+
+    if (!strip)
+    	addbuf(&buf, '@');
+    if (offset && (*offset = ftello (yyin)) < 0)
+	*offset = 0;
+    for(;;) {
+	c = getc (yyin);
+	if (c == '@') {
+	    if (!strip)
+	    	addbuf(&buf, c);
+	    c = getc (yyin);
+	    if (c != '@') 
+		break;
+	    if (offset)
+		*offset = 0;
+	}
+	addbuf(&buf, c);
+    }
+    ungetc (c, yyin);
+    if (length)
+	*length = buf.cur;
+    addbuf(&buf, 0);
+    if (strip) {
+       ret = atom (buf.string);
+       free (buf.string);
+    } else {
+       ret = buf.string;
+    }
+    return ret;
+}
+
+cvs_number
+lex_number (char *s)
+{
+    cvs_number	n;
+    char	*next;
+
+    n.c = 0;
+    while (*s) {
+	n.n[n.c] = (int) strtol(s, &next, 10);
+	if (next == s)
+	    break;
+	if (*next == '.')
+	    next++;
+	s = next;
+	n.c++;
+    }
+    return n;
+}
+
+time_t
+lex_date (cvs_number *n)
+{
+	struct tm	tm;
+	time_t		d;
+	
+	tm.tm_year = n->n[0];
+	if (tm.tm_year > 1900)
+	   tm.tm_year -= 1900;
+	tm.tm_mon = n->n[1] - 1;
+	tm.tm_mday = n->n[2];
+	tm.tm_hour = n->n[3];
+	tm.tm_min = n->n[4];
+	tm.tm_sec = n->n[5];
+	tm.tm_isdst = 0;
+	tm.tm_zone = 0;
+	d = mktime (&tm);
+	if (d == 0) {
+	    int i;
+	    fprintf (stderr, "%s: (%d) unparsable date: ", yyfilename,
+		     yylineno);
+	    for (i = 0; i < n->c; i++) {
+		if (i) fprintf (stderr, ".");
+		fprintf (stderr, "%d", n->n[i]);
+	    }
+	    fprintf (stderr, "\n");
+	}
+	return d;
+}
+
+void static fast_export_sanitize(void)
+{
+    char *sp, *tp;
+
+#define SUFFIX(a, s)	(strcmp(a + strlen(a) - strlen(s), s) == 0) 
+#define BADCHARS	"~^\\*?"
+    for (sp = tp = yytext; *sp; sp++) {
+	if (isgraph(*sp) && strchr(BADCHARS, *sp) == NULL) {
+	    *tp++ = *sp;
+	    if (SUFFIX(yytext, "@{") || SUFFIX(yytext, "..")) {
+		fprintf(stderr,
+			"%s: (%d) tag or branch name %s is ill-formed.\n", 
+			yyfilename, yylineno, yytext);
+		exit(1);
+	    }
+	}
+    }
+    *tp = '\0';
+    if (strlen(yytext) == 0) {
+	fprintf(stderr,
+		"%s: (%d) ag or branch name was empty after sanitization.\n", 
+		yyfilename, yylineno);
+	exit(1);
+    }
+}
+
+char *
+lex_text (void)
+{
+    return yytext;
+}
@@ -0,0 +1,509 @@
+/*
+ * Write git objects straight into a packfile and its index in a
+ * repository, and the refs as loose ref files, instead of handing a
+ * stream to git fast-import.  Each object goes into the pack once,
+ * however often it is offered; the pack header's object count and the
+ * trailing checksum are fixed up when the pack is closed.  A blob that
+ * comes with a delta against one already in the pack is stored as that
+ * delta, unless the chain of deltas behind it is already as long as
+ * git repack would make it.
+ */
+
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "cvs.h"
+
+#define PACK_MAX_DEPTH	50
+
+typedef struct _pack_entry {
+    unsigned char   sha1[20];
+    uint64_t	    offset;
+    uint32_t	    crc;
+    int		    depth;	/* of deltas to go through to get it */
+} pack_entry;
+
+/* The sorted object names of a pack the repository had already */
+typedef struct _pack_index {
+    struct _pack_index	*next;
+    unsigned char	*data;	/* the .idx file, read whole */
+    uint32_t		*fanout;
+    unsigned char	*sha1;
+} pack_index;
+
+static char		*git_dir;
+static char		pack_tmp[PATH_MAX + 32];
+static out_stream	*pack_out;
+static uint64_t		pack_offset;
+static pack_entry	*entries;
+static unsigned long	nentries, entriesmax;
+static unsigned long	*slots;		/* hash of entries, by index + 1 */
+static unsigned long	nslots;
+static pthread_mutex_t	pack_lock = PTHREAD_MUTEX_INITIALIZER;
+static pack_index	*old_packs;
+static bool		old_packs_read;
+
+static char *const type_name[] = {
+    [OBJ_COMMIT] = "commit", [OBJ_TREE] = "tree", [OBJ_BLOB] = "blob",
+};
+
+static void
+pack_die (char *what, char *name)
+{
+    fprintf (stderr, "parsecvs: %s %s: %s\n", what, name, strerror (errno));
+    exit (1);
+}
+
+static void
+put_be32 (unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/* The entries slot holding SHA1, or the empty one it would go in */
+static unsigned long *
+pack_slot (unsigned char *sha1)
+{
+    unsigned long   h;
+
+    memcpy (&h, sha1, sizeof (h));
+    for (h &= nslots - 1; slots[h]; h = (h + 1) & (nslots - 1))
+	if (memcmp (entries[slots[h] - 1].sha1, sha1, 20) == 0)
+	    break;
+    return &slots[h];
+}
+
+static void
+pack_add (unsigned char *sha1, uint64_t offset, uint32_t crc, int depth)
+{
+    unsigned long   i;
+
+    if (nentries == entriesmax) {
+	entriesmax = entriesmax ? entriesmax * 2 : 4096;
+	entries = xrealloc (entries, entriesmax * sizeof (pack_entry));
+    }
+    memcpy (entries[nentries].sha1, sha1, 20);
+    entries[nentries].offset = offset;
+    entries[nentries].crc = crc;
+    entries[nentries].depth = depth;
+    nentries++;
+    if (nentries * 2 > nslots) {
+	free (slots);
+	nslots = nslots ? nslots * 2 : 8192;
+	slots = xmalloc (nslots * sizeof (unsigned long));
+	memset (slots, 0, nslots * sizeof (unsigned long));
+	for (i = 0; i < nentries; i++)
+	    *pack_slot (entries[i].sha1) = i + 1;
+    } else
+	*pack_slot (sha1) = nentries;
+}
+
+static pack_entry *
+pack_find (unsigned char *sha1)
+{
+    unsigned long   i = nslots ? *pack_slot (sha1) : 0;
+
+    return i ? &entries[i - 1] : NULL;
+}
+
+static uint32_t
+get_be32 (const unsigned char *p)
+{
+    return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/* Read the index of each pack the repository already has */
+static void
+pack_read_indexes (void)
+{
+    char	    path[PATH_MAX];
+    DIR		    *dir;
+    struct dirent   *e;
+    struct stat	    st;
+    size_t	    len;
+    pack_index	    *p;
+    int		    fd;
+
+    snprintf (path, sizeof (path), "%s/objects/pack", git_dir);
+    if (!(dir = opendir (path)))
+	return;
+    while ((e = readdir (dir))) {
+	len = strlen (e->d_name);
+	if (len < 4 || strcmp (e->d_name + len - 4, ".idx") != 0)
+	    continue;
+	snprintf (path, sizeof (path), "%s/objects/pack/%s", git_dir, e->d_name);
+	if ((fd = open (path, O_RDONLY)) < 0)
+	    continue;
+	p = NULL;
+	if (fstat (fd, &st) == 0 && st.st_size >= 8 + 256 * 4) {
+	    p = xmalloc (sizeof (pack_index));
+	    p->data = xmalloc (st.st_size);
+	    if (read (fd, p->data, st.st_size) != st.st_size ||
+		memcmp (p->data, "\377tOc\0\0\0\2", 8) != 0 ||
+		8 + 256 * 4 + (uint64_t) get_be32 (p->data + 8 + 255 * 4) * 20 >
+		(uint64_t) st.st_size) {
+		free (p->data);
+		free (p);
+		p = NULL;
+	    }
+	}
+	close (fd);
+	if (!p)
+	    continue;
+	p->fanout = (uint32_t *) (p->data + 8);
+	p->sha1 = p->data + 8 + 256 * 4;
+	p->next = old_packs;
+	old_packs = p;
+    }
+    closedir (dir);
+}
+
+/*
+ * Whether the repository has the object SHA1, in a pack it had
+ * already, loose, or in the pack being written.
+ */
+bool
+pack_has_object (unsigned char *sha1)
+{
+    char	path[PATH_MAX];
+    pack_index	*p;
+    uint32_t	lo, hi, mid;
+    int		c, i;
+    struct stat	st;
+    bool	found;
+
+    pthread_mutex_lock (&pack_lock);
+    if (!old_packs_read) {
+	pack_read_indexes ();
+	old_packs_read = true;
+    }
+    found = pack_find (sha1) != NULL;
+    pthread_mutex_unlock (&pack_lock);
+    if (found)
+	return true;
+    for (p = old_packs; p; p = p->next) {
+	lo = sha1[0] ? get_be32 ((unsigned char *) &p->fanout[sha1[0] - 1]) : 0;
+	hi = get_be32 ((unsigned char *) &p->fanout[sha1[0]]);
+	while (lo < hi) {
+	    mid = lo + (hi - lo) / 2;
+	    c = memcmp (p->sha1 + (size_t) mid * 20, sha1, 20);
+	    if (c == 0)
+		return true;
+	    if (c < 0)
+		lo = mid + 1;
+	    else
+		hi = mid;
+	}
+    }
+    c = snprintf (path, sizeof (path), "%s/objects/%02x/", git_dir, sha1[0]);
+    for (i = 1; i < 20; i++)
+	c += snprintf (path + c, sizeof (path) - c, "%02x", sha1[i]);
+    return stat (path, &st) == 0;
+}
+
+void
+pack_open (char *repo)
+{
+    char    path[PATH_MAX];
+    char    header[12] = "PACK";
+    struct stat	st;
+    int	    fd;
+
+    snprintf (path, sizeof (path), "%s/.git", repo);
+    git_dir = strdup (stat (path, &st) == 0 && S_ISDIR (st.st_mode) ?
+		      path : repo);
+    snprintf (path, sizeof (path), "%s/objects/pack", git_dir);
+    if (stat (path, &st) < 0 || !S_ISDIR (st.st_mode)) {
+	fprintf (stderr, "parsecvs: %s is not a git repository\n", repo);
+	exit (1);
+    }
+    snprintf (pack_tmp, sizeof (pack_tmp), "%s/tmp_pack_XXXXXX", path);
+    if ((fd = mkstemp (pack_tmp)) < 0)
+	pack_die ("creating", pack_tmp);
+    close (fd);
+    pack_out = stream_open (pack_tmp, false);
+    put_be32 ((unsigned char *) header + 4, 2);
+    put_be32 ((unsigned char *) header + 8, 0);	/* count, filled in later */
+    stream_write (pack_out, header, sizeof (header));
+    pack_offset = sizeof (header);
+}
+
+/* The LEN bytes in IOV compressed, in *OUTLEN bytes */
+static unsigned char *
+pack_deflate (struct iovec *iov, int iovcnt, unsigned long len, size_t *outlen)
+{
+    unsigned char   *out;
+    z_stream	    z;
+    size_t	    outmax;
+    int		    i, flush;
+
+    memset (&z, 0, sizeof (z));
+    if (deflateInit (&z, Z_DEFAULT_COMPRESSION) != Z_OK) {
+	fprintf (stderr, "parsecvs: deflateInit failed\n");
+	exit (1);
+    }
+    outmax = deflateBound (&z, len) + 16;
+    out = xmalloc (outmax);
+    z.next_out = out;
+    z.avail_out = outmax;
+    for (i = 0; i <= iovcnt; i++) {
+	flush = i == iovcnt ? Z_FINISH : Z_NO_FLUSH;
+	z.next_in = i < iovcnt ? iov[i].iov_base : NULL;
+	z.avail_in = i < iovcnt ? iov[i].iov_len : 0;
+	while (z.avail_in || flush == Z_FINISH)
+	    if (deflate (&z, flush) == Z_STREAM_END)
+		break;
+    }
+    deflateEnd (&z);
+    *outlen = z.total_out;
+    return out;
+}
+
+/*
+ * Write the entry for SHA1, SIZE bytes of TYPE compressed into OUTLEN
+ * bytes at OUT, unless another thread got there first.  A delta names
+ * its BASE by how far back in the pack it is.  Called with pack_lock.
+ */
+static void
+pack_append (unsigned char *sha1, int type, unsigned long size,
+	     pack_entry *base, unsigned char *out, size_t outlen)
+{
+    unsigned char   header[32];
+    uint64_t	    ofs;
+    uint32_t	    crc;
+    int		    n = 0, depth = base ? base->depth + 1 : 0;
+    unsigned char   ofsbuf[10];
+    int		    k = sizeof (ofsbuf);
+
+    if (pack_find (sha1))
+	return;
+    header[n] = (type << 4) | (size & 15);
+    for (size >>= 4; size; size >>= 7) {
+	header[n++] |= 0x80;
+	header[n] = size & 0x7f;
+    }
+    n++;
+    if (base) {
+	/* big-endian, with one added to each more significant digit */
+	ofs = pack_offset - base->offset;
+	ofsbuf[--k] = ofs & 0x7f;
+	while ((ofs >>= 7))
+	    ofsbuf[--k] = 0x80 | (--ofs & 0x7f);
+	memcpy (header + n, ofsbuf + k, sizeof (ofsbuf) - k);
+	n += sizeof (ofsbuf) - k;
+    }
+    crc = crc32 (0, header, n);
+    crc = crc32 (crc, out, outlen);
+    pack_add (sha1, pack_offset, crc, depth);
+    stream_write (pack_out, header, n);
+    stream_write (pack_out, out, outlen);
+    pack_offset += n + outlen;
+}
+
+/* Put the object SHA1, LEN bytes of TYPE in IOV, into the pack whole */
+static void
+pack_whole (int type, struct iovec *iov, int iovcnt, unsigned long len,
+	    unsigned char *sha1)
+{
+    unsigned char   *out;
+    size_t	    outlen;
+
+    /* compress outside the lock, so threads making blobs share the work */
+    out = pack_deflate (iov, iovcnt, len, &outlen);
+    pthread_mutex_lock (&pack_lock);
+    pack_append (sha1, type, len, NULL, out, outlen);
+    pthread_mutex_unlock (&pack_lock);
+    free (out);
+}
+
+/* Name the LEN byte object of TYPE held in IOV, and put it in the pack */
+void
+pack_object (int type, struct iovec *iov, int iovcnt, unsigned long len,
+	     unsigned char *sha1)
+{
+    bool    have;
+
+    sha1_object (type_name[type], iov, iovcnt, len, sha1);
+    pthread_mutex_lock (&pack_lock);
+    have = pack_find (sha1) != NULL;
+    pthread_mutex_unlock (&pack_lock);
+    if (!have)
+	pack_whole (type, iov, iovcnt, len, sha1);
+}
+
+/*
+ * Name the LEN byte blob held in IOV, and put it in the pack as the
+ * DELTALEN byte git delta DELTA against the blob BASE, if it can be.
+ */
+void
+pack_delta (struct iovec *iov, int iovcnt, unsigned long len,
+	    unsigned char *base, char *delta, unsigned long deltalen,
+	    unsigned char *sha1)
+{
+    struct iovec    dv;
+    pack_entry	    *e;
+    unsigned char   *out;
+    size_t	    outlen;
+    bool	    have, usable;
+
+    sha1_object ("blob", iov, iovcnt, len, sha1);
+    pthread_mutex_lock (&pack_lock);
+    have = pack_find (sha1) != NULL;
+    e = pack_find (base);
+    usable = e && e->depth < PACK_MAX_DEPTH && deltalen < len;
+    pthread_mutex_unlock (&pack_lock);
+    if (have)
+	return;
+    if (!usable) {
+	pack_whole (OBJ_BLOB, iov, iovcnt, len, sha1);
+	return;
+    }
+    dv.iov_base = delta;
+    dv.iov_len = deltalen;
+    out = pack_deflate (&dv, 1, deltalen, &outlen);
+    pthread_mutex_lock (&pack_lock);
+    /* the table may have moved since */
+    pack_append (sha1, OBJ_OFS_DELTA, deltalen, pack_find (base), out, outlen);
+    pthread_mutex_unlock (&pack_lock);
+    free (out);
+}
+
+/* Point the loose ref NAME (refs/...) at SHA1 */
+void
+pack_ref (char *name, unsigned char *sha1)
+{
+    char    path[PATH_MAX], *slash;
+    FILE    *f;
+    int	    i;
+
+    snprintf (path, sizeof (path), "%s/%s", git_dir, name);
+    for (slash = path + strlen (git_dir) + 1; (slash = strchr (slash, '/')); slash++) {
+	*slash = '\0';
+	if (mkdir (path, 0777) < 0 && errno != EEXIST)
+	    pack_die ("creating", path);
+	*slash = '/';
+    }
+    if (!(f = fopen (path, "w")))
+	pack_die ("writing", path);
+    for (i = 0; i < 20; i++)
+	fprintf (f, "%02x", sha1[i]);
+    fputc ('\n', f);
+    if (fclose (f) == EOF)
+	pack_die ("writing", path);
+}
+
+static int
+compare_entries (const void *a, const void *b)
+{
+    return memcmp (((const pack_entry *) a)->sha1,
+		   ((const pack_entry *) b)->sha1, 20);
+}
+
+/* Write to the index and take its checksum as we go */
+static void
+idx_write (out_stream *s, sha1_ctx *ctx, const void *p, size_t n)
+{
+    sha1_update (ctx, p, n);
+    stream_write (s, p, n);
+}
+
+static void
+pack_write_idx (char *name, unsigned char *pack_sha1)
+{
+    out_stream	    *s = stream_open (name, false);
+    sha1_ctx	    ctx;
+    unsigned char   word[8], sha1[20];
+    unsigned long   i, nlarge = 0;
+    uint32_t	    fanout[256];
+
+    sha1_init (&ctx);
+    idx_write (s, &ctx, "\377tOc\0\0\0\2", 8);
+    memset (fanout, 0, sizeof (fanout));
+    for (i = 0; i < nentries; i++)
+	fanout[entries[i].sha1[0]]++;
+    for (i = 1; i < 256; i++)
+	fanout[i] += fanout[i-1];
+    for (i = 0; i < 256; i++) {
+	put_be32 (word, fanout[i]);
+	idx_write (s, &ctx, word, 4);
+    }
+    for (i = 0; i < nentries; i++)
+	idx_write (s, &ctx, entries[i].sha1, 20);
+    for (i = 0; i < nentries; i++) {
+	put_be32 (word, entries[i].crc);
+	idx_write (s, &ctx, word, 4);
+    }
+    /* offsets past 2GB go in a table of their own */
+    for (i = 0; i < nentries; i++) {
+	if (entries[i].offset < 0x80000000)
+	    put_be32 (word, entries[i].offset);
+	else
+	    put_be32 (word, 0x80000000 | nlarge++);
+	idx_write (s, &ctx, word, 4);
+    }
+    for (i = 0; i < nentries; i++)
+	if (entries[i].offset >= 0x80000000) {
+	    put_be32 (word, entries[i].offset >> 32);
+	    put_be32 (word + 4, entries[i].offset);
+	    idx_write (s, &ctx, word, 8);
+	}
+    idx_write (s, &ctx, pack_sha1, 20);
+    sha1_final (&ctx, sha1);
+    stream_write (s, sha1, 20);
+    stream_close (s);
+}
+
+void
+pack_close (void)
+{
+    char	    path[PATH_MAX], idx_tmp[sizeof (pack_tmp) + 8], hex[41];
+    unsigned char   count[4], sha1[20], *buf;
+    sha1_ctx	    ctx;
+    ssize_t	    n;
+    int		    fd, i;
+
+    stream_close (pack_out);
+    if ((fd = open (pack_tmp, O_RDWR)) < 0)
+	pack_die ("reopening", pack_tmp);
+    put_be32 (count, nentries);
+    if (pwrite (fd, count, 4, 8) != 4)
+	pack_die ("writing", pack_tmp);
+    buf = xmalloc (1 << 20);
+    sha1_init (&ctx);
+    while ((n = read (fd, buf, 1 << 20)) > 0)
+	sha1_update (&ctx, buf, n);
+    if (n < 0)
+	pack_die ("reading", pack_tmp);
+    free (buf);
+    sha1_final (&ctx, sha1);
+    if (write (fd, sha1, 20) != 20 || close (fd) < 0)
+	pack_die ("writing", pack_tmp);
+
+    for (i = 0; i < 20; i++)
+	sprintf (hex + 2 * i, "%02x", sha1[i]);
+    qsort (entries, nentries, sizeof (pack_entry), compare_entries);
+    snprintf (idx_tmp, sizeof (idx_tmp), "%s.idx", pack_tmp);
+    pack_write_idx (idx_tmp, sha1);
+    snprintf (path, sizeof (path), "%s/objects/pack/pack-%s.pack", git_dir, hex);
+    if (rename (pack_tmp, path) < 0)
+	pack_die ("renaming", pack_tmp);
+    snprintf (path, sizeof (path), "%s/objects/pack/pack-%s.idx", git_dir, hex);
+    if (rename (idx_tmp, path) < 0)
+	pack_die ("renaming", idx_tmp);
+    fprintf (stderr, "Pack: %lu objects in pack-%s\n", nentries, hex);
+    while (old_packs) {
+	pack_index  *p = old_packs;
+
+	old_packs = p->next;
+	free (p->data);
+	free (p);
+    }
+    free (entries);
+    free (slots);
+    free (git_dir);
+}
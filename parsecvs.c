@@ -27,15 +27,27 @@
 #endif
 
 typedef enum _rev_execution_mode {
-    ExecuteExport, ExecuteGraph, ExecuteSplits
+    ExecuteExport, ExecuteGraph, ExecuteSplits, ExecuteDiffstat
 } rev_execution_mode;
 
 /* options */
 int commit_time_window = 300;
 bool force_dates = false;
 bool suppress_keyword_expansion = false;
+line_store_mode line_store = LineStoreMerge;
+int threads = 1;
+bool dedup_blobs = false;
+char *blob_output, *commit_output;
+bool blob_shards = false;
+bool writer_thread = false;
+bool compress_output = false;
+bool inline_blobs = false;
+char *pack_repo;
+char *cache_dir;
+bool late_blobs = false;
 bool reposurgeon;
 FILE *revision_map;
+FILE *annotate_file;
 static int verbose = 0;
 static rev_execution_mode rev_mode = ExecuteExport;
 
@@ -153,10 +165,9 @@ extern int yylineno;
 
 cvs_file	*this_file;
 
-static rev_list *
-rev_list_file (char *name, int *nversions)
+static void
+rev_parse_file (char *name)
 {
-    rev_list	*rl;
     struct stat	buf;
 
     yyin = fopen (name, "r");
@@ -174,9 +185,154 @@ rev_list_file (char *name, int *nversions)
     yyparse ();
     fclose (yyin);
     yyfilename = 0;
+}
+
+typedef struct _rev_filename {
+    struct _rev_filename	*next;
+    char		*file;
+    int			id, dir;	/* as in rev_file */
+    rev_file		**revs;		/* live ones by number, --late-blobs */
+    int			nrevs;
+} rev_filename;
+
+static int
+compare_filenames (const void *a, const void *b)
+{
+    return strcmp ((*(rev_filename * const *) a)->file,
+		   (*(rev_filename * const *) b)->file);
+}
+
+/*
+ * Number the N files in LIST in name order, so that the files of a
+ * commit can be put in order, and matched with its parent's, by
+ * comparing numbers.  Neighbours in that order that are in the same
+ * directory share a dir number as well.
+ */
+static void
+number_files (rev_filename *list, int n)
+{
+    rev_filename    **v = xmalloc ((n + 1) * sizeof (rev_filename *));
+    rev_filename    *fn, *prev = NULL;
+    char	    *slash;
+    int		    i, id = -1, dir = -1, len, prevlen = -1;
+
+    for (i = 0, fn = list; fn; fn = fn->next)
+	v[i++] = fn;
+    qsort (v, n, sizeof (rev_filename *), compare_filenames);
+    for (i = 0; i < n; i++) {
+	fn = v[i];
+	slash = strrchr (fn->file, '/');
+	len = slash ? slash - fn->file : 0;
+	/* a file named twice is the same file */
+	if (!prev || prev->file != fn->file)
+	    id++;
+	if (len != prevlen || strncmp (fn->file, prev->file, len) != 0)
+	    dir++;
+	fn->id = id;
+	fn->dir = dir;
+	prev = fn;
+	prevlen = len;
+    }
+    free (v);
+}
+
+static int
+compare_rev_files (const void *a, const void *b)
+{
+    return cvs_number_compare (&(*(rev_file * const *) a)->number,
+			       &(*(rev_file * const *) b)->number);
+}
+
+/* Keep the revisions of this_file that have blobs until after the merge */
+static void
+late_save (rev_filename *fn)
+{
+    cvs_version	*v;
+
+    for (v = this_file->versions; v; v = v->next)
+	if (v->node && v->node->file)
+	    fn->nrevs++;
+    fn->revs = xmalloc ((fn->nrevs + 1) * sizeof (rev_file *));
+    fn->nrevs = 0;
+    for (v = this_file->versions; v; v = v->next)
+	if (v->node && v->node->file)
+	    fn->revs[fn->nrevs++] = v->node->file;
+    qsort (fn->revs, fn->nrevs, sizeof (rev_file *), compare_rev_files);
+}
+
+/*
+ * Parse FN again and generate the blobs of just those revisions that
+ * exported commits use, as marked by export_used_files.  A file none
+ * of whose revisions are used is not read at all.
+ */
+static int
+late_generate (rev_filename *fn)
+{
+    cvs_version	*v;
+    rev_file	key, *k = &key, **f;
+    int		i, n = 0;
+
+    for (i = 0; i < fn->nrevs; i++)
+	if (fn->revs[i]->used)
+	    n++;
+    if (!n)
+	return 0;
+    rev_parse_file (fn->file);
+    build_branches ();
+    for (v = this_file->versions; v; v = v->next) {
+	if (!v->node || v->dead)
+	    continue;
+	key.number = v->number;
+	f = bsearch (&k, fn->revs, fn->nrevs, sizeof (rev_file *),
+		     compare_rev_files);
+	if (f && (*f)->used)
+	    v->node->file = *f;
+    }
+    if (cache_dir)
+	cache_generate (this_file);
+    else
+	generate_files (this_file, export_blob);
+    cvs_file_free (this_file);
+    return n;
+}
+
+/* Generate the blobs used by the commits of RL, from the FILES kept */
+static void
+late_generate_all (rev_filename *files, rev_list *rl)
+{
+    rev_filename    *fn;
+    long	    nused = 0, nrevs = 0;
+    int		    n, nread = 0, nfiles = 0;
+
+    export_used_files (rl);
+    for (fn = files; fn; fn = fn->next) {
+	if ((n = late_generate (fn)))
+	    nread++;
+	nused += n;
+	nrevs += fn->nrevs;
+	nfiles++;
+    }
+    fprintf (stderr, "Blobs: %ld of %ld revisions used, from %d of %d files\n",
+	     nused, nrevs, nread, nfiles);
+}
+
+static rev_list *
+rev_list_file (rev_filename *fn, int *nversions)
+{
+    rev_list	*rl;
+
+    rev_parse_file (fn->file);
+    this_file->id = fn->id;
+    this_file->dir = fn->dir;
     rl = rev_list_cvs (this_file);
-    if (rev_mode == ExecuteExport)
+    if (rev_mode == ExecuteExport && late_blobs)
+	late_save (fn);
+    else if (rev_mode == ExecuteExport && cache_dir)
+	cache_generate (this_file);
+    else if (rev_mode == ExecuteExport)
 	generate_files(this_file, export_blob);
+    else if (rev_mode == ExecuteDiffstat)
+	generate_diffstat(this_file);
    
     *nversions = this_file->nversions;
     cvs_file_free (this_file);
@@ -382,10 +538,32 @@ strcommon (char *a, char *b)
     return c;
 }
 
-typedef struct _rev_filename {
-    struct _rev_filename	*next;
-    char		*file;
-} rev_filename;
+static int
+checkout_revision (char *name, char *rev)
+/* write revision REV of NAME to stdout */
+{
+    cvs_number	    number;
+    unsigned long   len;
+    char	    *text;
+
+    if (access (name, R_OK) != 0) {
+	perror (name);
+	return 1;
+    }
+    rev_parse_file (name);
+    build_branches ();
+    number = lex_number (rev);
+    text = generate_revision (this_file, &number, &len);
+    if (!text) {
+	fprintf (stderr, "parsecvs: %s has no revision %s\n", name, rev);
+	cvs_file_free (this_file);
+	return 1;
+    }
+    fwrite (text, 1, len, stdout);
+    free (text);
+    cvs_file_free (this_file);
+    return 0;
+}
 
 int load_current_file, load_total_files;
 
@@ -393,6 +571,7 @@ int
 main (int argc, char **argv)
 {
     rev_filename    *fn_head, **fn_tail = &fn_head, *fn;
+    rev_filename    *late_head = NULL, **late_tail = &late_head;
     rev_list	    *head, **tail = &head;
     rev_list	    *rl;
     int		    j = 1;
@@ -400,6 +579,8 @@ main (int argc, char **argv)
     int		    strip = -1;
     int		    c;
     char	    *file;
+    char	    *percent;
+    char	    *checkout = NULL;
     int		    nfile = 0;
 
     while (1) {
@@ -412,8 +593,23 @@ main (int argc, char **argv)
 	    { "revision-map",       1, 0, 'R' },
 	    { "reposurgeon",        1, 0, 'r' },
             { "graph",              0, 0, 'g' },
+	    { "line-store",         1, 0, 'L' },
+	    { "threads",            1, 0, 'j' },
+	    { "checkout",           1, 0, 'c' },
+	    { "diffstat",           0, 0, 'd' },
+	    { "annotate",           1, 0, 'a' },
+	    { "dedup",              0, 0, 'D' },
+	    { "blob-output",        1, 0, 'B' },
+	    { "commit-output",      1, 0, 'C' },
+	    { "writer-thread",      0, 0, 'W' },
+	    { "pack",               1, 0, 'P' },
+	    { "compress",           0, 0, 'z' },
+	    { "inline",             0, 0, 'I' },
+	    { "cache",              1, 0, 'K' },
+	    { "late-blobs",         0, 0, 'l' },
+	    { 0,                    0, 0, 0 },
 	};
-	int c = getopt_long(argc, argv, "+hVw:grvA:R:T", options, NULL);
+	int c = getopt_long(argc, argv, "+hVw:grvA:R:TL:j:c:da:DB:C:WP:zIK:l", options, NULL);
 	if (c < 0)
 	    break;
 	switch (c) {
@@ -423,19 +619,36 @@ main (int argc, char **argv)
                    "Mandatory arguments to long options are mandatory for short options too.\n"
                    " -h --help                       This help\n"
 		   " -g --graph                      Dump the commit graph\n"
+		   " -d --diffstat                   Report line churn per commit\n"
 		   " -k                              Suppress keyword expansion\n"
                    " -v --version                    Print version\n"
                    " -w --commit-time-window=WINDOW  Time window for commits (seconds)\n"
 		   " -A --authormap                  Author map file\n"
 		   " -R --revision-map               Revision map file\n"
+		   " -a --annotate=FILE              Write the origin of every line to FILE\n"
 		   " -r --reposurgeon                Issue cvs-revision properties\n"
 		   " -T                              Force deterministic dates\n"
+		   " -L --line-store=merge|gap|rope  Line store used to apply deltas\n"
+		   " -j --threads=N                  Threads generating branches and commits\n"
+		   " -D --dedup                      Write each distinct blob only once\n"
+		   " -B --blob-output=FILE           Write blobs to FILE, %%d for a shard per thread\n"
+		   " -C --commit-output=FILE         Write commits to FILE\n"
+		   " -W --writer-thread              Write the stream from a thread of its own\n"
+		   " -P --pack=REPO                  Write a packfile and refs into git REPO\n"
+		   " -z --compress                   Write the stream gzipped, on several threads\n"
+		   " -I --inline                     Write blobs inline in commits, without marks\n"
+		   " -K --cache=DIR                  Keep blobs in DIR for unchanged files next run\n"
+		   " -l --late-blobs                 Generate only the blobs commits use, after the merge\n"
+		   " -c --checkout=FILE,v REV        Write one revision of FILE,v to stdout\n"
 		   "\n"
 		   "Example: find -name '*,v' | parsecvs\n");
 	    return 0;
 	case 'g':
 	    rev_mode = ExecuteGraph;
 	    break;
+	case 'd':
+	    rev_mode = ExecuteDiffstat;
+	    break;
         case 'k':
 	    suppress_keyword_expansion = true;
 	    break;
@@ -458,18 +671,97 @@ main (int argc, char **argv)
 	case 'R':
 	    revision_map = fopen(optarg, "w");
 	    break;
+	case 'a':
+	    annotate_file = fopen(optarg, "w");
+	    if (!annotate_file) {
+		fprintf(stderr, "parsecvs: %s: %s\n", optarg, strerror(errno));
+		return 1;
+	    }
+	    break;
+	case 'D':
+	    dedup_blobs = true;
+	    break;
+	case 'B':
+	    blob_output = optarg;
+	    /* the name is used as a format, so allow nothing but one %d */
+	    percent = strchr (optarg, '%');
+	    blob_shards = percent != NULL;
+	    if (percent && (percent[1] != 'd' || strchr (percent + 2, '%'))) {
+		fprintf(stderr, "parsecvs: only one %%d may appear in %s\n", optarg);
+		return 1;
+	    }
+	    break;
+	case 'C':
+	    commit_output = optarg;
+	    break;
+	case 'W':
+	    writer_thread = true;
+	    break;
+	case 'P':
+	    pack_repo = optarg;
+	    break;
+	case 'z':
+	    compress_output = true;
+	    break;
+	case 'I':
+	    inline_blobs = true;
+	    break;
+	case 'l':
+	    late_blobs = true;
+	    break;
+	case 'K':
+	    cache_dir = optarg;
+	    if (mkdir (cache_dir, 0777) < 0 && errno != EEXIST) {
+		fprintf(stderr, "parsecvs: %s: %s\n", optarg, strerror(errno));
+		return 1;
+	    }
+	    break;
 	case 'r':
 	    reposurgeon = true;
 	    break;
 	case 'T':
 	    force_dates = true;
 	    break;
+	case 'L':
+	    if (strcmp(optarg, "merge") == 0)
+		line_store = LineStoreMerge;
+	    else if (strcmp(optarg, "gap") == 0)
+		line_store = LineStoreGap;
+	    else if (strcmp(optarg, "rope") == 0)
+		line_store = LineStoreRope;
+	    else {
+		fprintf(stderr, "parsecvs: unknown line store %s\n", optarg);
+		return 1;
+	    }
+	    break;
+	case 'c':
+	    checkout = optarg;
+	    break;
+	case 'j':
+	    threads = atoi (optarg);
+	    if (threads < 1) {
+		fprintf(stderr, "parsecvs: bad thread count %s\n", optarg);
+		return 1;
+	    }
+	    break;
 	default: /* error message already emitted */
 	    fprintf(stderr, "Try `%s --help' for more information.\n", argv[0]);
 	    return 1;
 	}
     }
 
+    /* a pack has no commits to put the blobs in */
+    if (pack_repo)
+	inline_blobs = false;
+
+    if (checkout) {
+	if (optind != argc - 1) {
+	    fprintf(stderr, "parsecvs: --checkout takes a file and one revision\n");
+	    return 1;
+	}
+	return checkout_revision (checkout, argv[optind]);
+    }
+
     argv[optind-1] = argv[0];
     argv += optind-1;
     argc -= optind-1;
@@ -519,6 +811,10 @@ main (int argc, char **argv)
 	last = fn->file;
 	nfile++;
     }
+    *fn_tail = NULL;
+    number_files (fn_head, nfile);
+    for (fn = fn_head; fn; fn = fn->next)
+	export_name_file (fn->id, fn->file, strip);
     if (rev_mode == ExecuteExport)
 	export_init();
     load_total_files = nfile;
@@ -532,13 +828,18 @@ main (int argc, char **argv)
 	if (verbose)
 	    fprintf(stderr, "parsecvs: processing %s\n", fn->file);
 	load_status (fn->file + strip);
-	rl = rev_list_file (fn->file, &nversions);
+	rl = rev_list_file (fn, &nversions);
 	if (rl->watch)
 	    dump_rev_tree (rl);
 	*tail = rl;
 	tail = &rl->next;
 
-	free(fn);
+	if (fn->revs) {
+	    fn->next = NULL;
+	    *late_tail = fn;
+	    late_tail = &fn->next;
+	} else
+	    free(fn);
     }
     if (skew_vulnerable > 0)
 	fprintf(stderr, "Commits before this date lack commitids: %s",
@@ -554,7 +855,14 @@ main (int argc, char **argv)
 	    dump_splits (rl);
 	    break;
 	case ExecuteExport:
+	    if (late_blobs)
+		late_generate_all (late_head, rl);
 	    export_commits (rl, strip);
+	    if (dedup_blobs)
+		export_dedup_report ();
+	    break;
+	case ExecuteDiffstat:
+	    diffstat_commits (rl, strip);
 	    break;
 	}
     }
@@ -565,6 +873,11 @@ main (int argc, char **argv)
 	head = head->next;
 	rev_list_free (rl, 1);
     }
+    while ((fn = late_head)) {
+	late_head = fn->next;
+	free (fn->revs);
+	free (fn);
+    }
     discard_atoms ();
     discard_tags ();
     rev_free_dirs ();
@@ -572,5 +885,9 @@ main (int argc, char **argv)
     free_author_map ();
     if (revision_map)
 	fclose(revision_map);
+    if (annotate_file)
+	fclose(annotate_file);
+    if (rev_mode == ExecuteExport)
+	export_close ();
     return err;
 }
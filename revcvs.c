@@ -76,7 +76,7 @@ rev_branch_cvs (cvs_file *cvs, cvs_number *branch)
 	else
 	    c->nfiles = 1;
 	/* leave this around so the branch merging stuff can find numbers */
-	c->file = rev_file_rev (cvs->name, &v->number, v->date);
+	c->file = rev_file_rev (cvs, &v->number, v->date);
 	if (!v->dead) {
 	    node->file = c->file;
 	    c->file->mode = cvs->mode;
@@ -18,12 +18,13 @@
 
 #include "cvs.h"
 
+/* File ids go in name order */
 static int
 compare_names (const void *a, const void *b)
 {
-    const rev_file	*af = a, *bf = b;
+    const rev_file	*af = *(rev_file * const *) a, *bf = *(rev_file * const *) b;
 
-    return strcmp (af->name, bf->name);
+    return af->id - bf->id;
 }
 
 #define REV_DIR_HASH	288361
@@ -103,9 +104,6 @@ rev_free_dirs (void)
 rev_dir **
 rev_pack_files (rev_file **files, int nfiles, int *ndr)
 {
-    char    *dir = 0;
-    char    *slash;
-    int	    dirlen = 0;
     int	    i;
     int	    start = 0;
     int	    nds = 0;
@@ -118,22 +116,14 @@ rev_pack_files (rev_file **files, int nfiles, int *ndr)
     qsort (files, nfiles, sizeof (rev_file *), compare_names);
 
     /* pull out directories */
-    for (i = 0; i < nfiles; i++) {
-	if (!dir || strncmp (files[i]->name, dir, dirlen) != 0)
+    for (i = 1; i < nfiles; i++) {
+	if (files[i]->dir != files[start]->dir)
 	{
-	    if (i > start) {
-		rd = rev_pack_dir (files + start, i - start);
-		if (nds == sds)
-		    rds = realloc (rds, (sds *= 2) * sizeof (rev_dir *));
-		rds[nds++] = rd;
-	    }
+	    rd = rev_pack_dir (files + start, i - start);
+	    if (nds == sds)
+		rds = realloc (rds, (sds *= 2) * sizeof (rev_dir *));
+	    rds[nds++] = rd;
 	    start = i;
-	    dir = files[i]->name;
-	    slash = strrchr (dir, '/');
-	    if (slash)
-		dirlen = slash - dir;
-	    else
-		dirlen = 0;
 	}
     }
     rd = rev_pack_dir (files + start, nfiles - start);
@@ -1032,11 +1032,13 @@ rev_file_free_marked (void)
 }
 
 rev_file *
-rev_file_rev (char *name, cvs_number *n, time_t date)
+rev_file_rev (cvs_file *cvs, cvs_number *n, time_t date)
 {
     rev_file	*f = calloc (1, sizeof (rev_file));
 
-    f->name = name;
+    f->name = cvs->name;
+    f->id = cvs->id;
+    f->dir = cvs->dir;
     f->number = *n;
     f->date = date;
     return f;
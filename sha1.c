@@ -0,0 +1,147 @@
+/*
+ * SHA-1, as git names its objects with it.  Plain FIPS 180-1, one
+ * 64 byte block at a time.
+ */
+
+#include "cvs.h"
+
+#define rol(x, n)	(((x) << (n)) | ((x) >> (32 - (n))))
+
+/*
+ * The rounds are unrolled and the message schedule kept as a ring of
+ * 16 words, which lets the compiler hold the working set in registers.
+ */
+#define W(i)		w[(i) & 15]
+#define SRC(i)		(W(i) = (uint32_t) p[(i)*4] << 24 | \
+			 (uint32_t) p[(i)*4+1] << 16 | \
+			 (uint32_t) p[(i)*4+2] << 8 | p[(i)*4+3])
+#define MIX(i)		(W(i) = rol (W((i)+13) ^ W((i)+8) ^ W((i)+2) ^ W(i), 1))
+#define ROUND(i, a, b, c, d, e, f, k, x) \
+	do { \
+	    uint32_t t = x; \
+	    e += t + rol (a, 5) + (f) + (k); \
+	    b = rol (b, 30); \
+	} while (0)
+#define F1(b, c, d)	(((c ^ d) & b) ^ d)
+#define F2(b, c, d)	(b ^ c ^ d)
+#define F3(b, c, d)	((b & c) + (d & (b ^ c)))
+#define R1S(i, a, b, c, d, e)	ROUND (i, a, b, c, d, e, F1 (b, c, d), 0x5a827999, SRC (i))
+#define R1(i, a, b, c, d, e)	ROUND (i, a, b, c, d, e, F1 (b, c, d), 0x5a827999, MIX (i))
+#define R2(i, a, b, c, d, e)	ROUND (i, a, b, c, d, e, F2 (b, c, d), 0x6ed9eba1, MIX (i))
+#define R3(i, a, b, c, d, e)	ROUND (i, a, b, c, d, e, F3 (b, c, d), 0x8f1bbcdc, MIX (i))
+#define R4(i, a, b, c, d, e)	ROUND (i, a, b, c, d, e, F2 (b, c, d), 0xca62c1d6, MIX (i))
+#define FIVE(R, i) \
+	do { \
+	    R ((i), a, b, c, d, e); \
+	    R ((i)+1, e, a, b, c, d); \
+	    R ((i)+2, d, e, a, b, c); \
+	    R ((i)+3, c, d, e, a, b); \
+	    R ((i)+4, b, c, d, e, a); \
+	} while (0)
+
+static void
+sha1_block (sha1_ctx *ctx, const unsigned char *p)
+{
+    uint32_t	w[16], a, b, c, d, e;
+
+    a = ctx->h[0];
+    b = ctx->h[1];
+    c = ctx->h[2];
+    d = ctx->h[3];
+    e = ctx->h[4];
+    FIVE (R1S, 0);
+    FIVE (R1S, 5);
+    FIVE (R1S, 10);
+    R1S (15, a, b, c, d, e);
+    R1 (16, e, a, b, c, d);
+    R1 (17, d, e, a, b, c);
+    R1 (18, c, d, e, a, b);
+    R1 (19, b, c, d, e, a);
+    FIVE (R2, 20);
+    FIVE (R2, 25);
+    FIVE (R2, 30);
+    FIVE (R2, 35);
+    FIVE (R3, 40);
+    FIVE (R3, 45);
+    FIVE (R3, 50);
+    FIVE (R3, 55);
+    FIVE (R4, 60);
+    FIVE (R4, 65);
+    FIVE (R4, 70);
+    FIVE (R4, 75);
+    ctx->h[0] += a;
+    ctx->h[1] += b;
+    ctx->h[2] += c;
+    ctx->h[3] += d;
+    ctx->h[4] += e;
+}
+
+void
+sha1_init (sha1_ctx *ctx)
+{
+    ctx->h[0] = 0x67452301;
+    ctx->h[1] = 0xefcdab89;
+    ctx->h[2] = 0x98badcfe;
+    ctx->h[3] = 0x10325476;
+    ctx->h[4] = 0xc3d2e1f0;
+    ctx->len = 0;
+}
+
+void
+sha1_update (sha1_ctx *ctx, const void *data, size_t len)
+{
+    const unsigned char	*p = data;
+    size_t		used = ctx->len & 63, n;
+
+    ctx->len += len;
+    if (used) {
+	n = 64 - used < len ? 64 - used : len;
+	memcpy (ctx->buf + used, p, n);
+	p += n;
+	len -= n;
+	if (used + n < 64)
+	    return;
+	sha1_block (ctx, ctx->buf);
+    }
+    for (; len >= 64; p += 64, len -= 64)
+	sha1_block (ctx, p);
+    memcpy (ctx->buf, p, len);
+}
+
+void
+sha1_final (sha1_ctx *ctx, unsigned char *digest)
+{
+    uint64_t	bits = ctx->len << 3;
+    size_t	used = ctx->len & 63;
+    int		i;
+
+    ctx->buf[used++] = 0x80;
+    if (used > 56) {
+	memset (ctx->buf + used, 0, 64 - used);
+	sha1_block (ctx, ctx->buf);
+	used = 0;
+    }
+    memset (ctx->buf + used, 0, 56 - used);
+    for (i = 0; i < 8; i++)
+	ctx->buf[56 + i] = bits >> (56 - 8 * i);
+    sha1_block (ctx, ctx->buf);
+    for (i = 0; i < 20; i++)
+	digest[i] = ctx->h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+/* the name git gives an object of TYPE, of LEN bytes held in IOV */
+void
+sha1_object (const char *type, struct iovec *iov, int iovcnt,
+	     unsigned long len, unsigned char *digest)
+{
+    sha1_ctx	ctx;
+    char	header[32];
+    int		i;
+
+    sha1_init (&ctx);
+    sha1_update (&ctx, header, snprintf (header, sizeof (header),
+					 "%s %lu", type, len) + 1);
+    for (i = 0; i < iovcnt; i++)
+	sha1_update (&ctx, iov[i].iov_base, iov[i].iov_len);
+    sha1_final (&ctx, digest);
+}
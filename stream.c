@@ -0,0 +1,459 @@
+/*
+ * Buffered output for the fast-import stream.  Output is gathered in
+ * large chunks and written with write(2); blob slices that would fill
+ * a chunk on their own go straight out with writev(2).  Marks, sizes
+ * and modes are formatted by hand, and with --writer-thread the full
+ * chunks are written by a thread of their own, so that generating the
+ * next blob goes on while a full pipe to git fast-import drains.
+ *
+ * With --compress, each full chunk becomes a gzip member of its own,
+ * made by whichever of a pool of threads gets to it first, and the
+ * writer thread puts the members out in order; gzip -d reads the
+ * members one after the other as a single file.
+ */
+
+#include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/sendfile.h>
+#include <zlib.h>
+#include "cvs.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX	1024
+#endif
+
+#define STREAM_CHUNK	(1 << 20)
+#define STREAM_QUEUE	16	/* chunks waiting for the writer thread */
+
+typedef struct _stream_chunk {
+    struct _stream_chunk    *next;
+    size_t		    len;
+    bool		    claimed, done;	/* by a compressor */
+    unsigned char	    *zdata;
+    size_t		    zlen, zmax;
+    char		    data[STREAM_CHUNK];
+} stream_chunk;
+
+struct _out_stream {
+    int			fd;
+    bool		own_fd;
+    char		*name;
+    stream_chunk	*cur;
+    /* writer thread */
+    bool		threaded;
+    bool		closing;
+    pthread_t		writer;
+    pthread_mutex_t	lock;
+    pthread_cond_t	cond;
+    stream_chunk	*queue, **tail;
+    int			nqueue;
+    stream_chunk	*spare;
+    /* compressor threads */
+    pthread_t		*gzip;
+    int			ngzip;
+};
+
+static void
+stream_error (out_stream *s)
+{
+    fprintf (stderr, "parsecvs: writing %s: %s\n", s->name, strerror (errno));
+    exit (1);
+}
+
+static void
+write_all (out_stream *s, const char *p, size_t n)
+{
+    ssize_t w;
+
+    while (n) {
+	w = write (s->fd, p, n);
+	if (w < 0) {
+	    if (errno == EINTR)
+		continue;
+	    stream_error (s);
+	}
+	p += w;
+	n -= w;
+    }
+}
+
+/*
+ * Write out all of IOV, which may hold more than IOV_MAX slices.  The
+ * slices still point into the ,v text.
+ */
+static void
+writev_all (out_stream *s, struct iovec *iov, int iovcnt)
+{
+    ssize_t n;
+
+    while (iovcnt) {
+	n = writev (s->fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    stream_error (s);
+	}
+	while (iovcnt && (size_t) n >= iov->iov_len) {
+	    n -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (n) {
+	    iov->iov_base = (char *) iov->iov_base + n;
+	    iov->iov_len -= n;
+	}
+    }
+}
+
+/* Make chunk C into a gzip member */
+static void
+stream_deflate (out_stream *s, stream_chunk *c)
+{
+    z_stream	z;
+
+    memset (&z, 0, sizeof (z));
+    /* a window of 15 bits, and 16 more for a gzip header and trailer */
+    if (deflateInit2 (&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+		      Z_DEFAULT_STRATEGY) != Z_OK) {
+	fprintf (stderr, "parsecvs: deflateInit2 failed\n");
+	exit (1);
+    }
+    if (!c->zdata) {
+	c->zmax = deflateBound (&z, STREAM_CHUNK);
+	c->zdata = xmalloc (c->zmax);
+    }
+    z.next_in = (unsigned char *) c->data;
+    z.avail_in = c->len;
+    z.next_out = c->zdata;
+    z.avail_out = c->zmax;
+    if (deflate (&z, Z_FINISH) != Z_STREAM_END) {
+	fprintf (stderr, "parsecvs: compressing %s failed\n", s->name);
+	exit (1);
+    }
+    c->zlen = z.total_out;
+    deflateEnd (&z);
+}
+
+static void *
+stream_compressor (void *arg)
+{
+    out_stream	    *s = arg;
+    stream_chunk    *c;
+
+    pthread_mutex_lock (&s->lock);
+    for (;;) {
+	for (c = s->queue; c && c->claimed; c = c->next)
+	    ;
+	if (!c) {
+	    if (s->closing)
+		break;
+	    pthread_cond_wait (&s->cond, &s->lock);
+	    continue;
+	}
+	c->claimed = true;
+	pthread_mutex_unlock (&s->lock);
+	stream_deflate (s, c);
+	pthread_mutex_lock (&s->lock);
+	c->done = true;
+	pthread_cond_broadcast (&s->cond);
+    }
+    pthread_mutex_unlock (&s->lock);
+    return NULL;
+}
+
+static void *
+stream_writer (void *arg)
+{
+    out_stream	    *s = arg;
+    stream_chunk    *c;
+
+    pthread_mutex_lock (&s->lock);
+    for (;;) {
+	while ((!s->queue && !s->closing) ||
+	       (s->queue && s->ngzip && !s->queue->done))
+	    pthread_cond_wait (&s->cond, &s->lock);
+	if (!(c = s->queue))
+	    break;
+	pthread_mutex_unlock (&s->lock);
+	if (s->ngzip)
+	    write_all (s, (char *) c->zdata, c->zlen);
+	else
+	    write_all (s, c->data, c->len);
+	pthread_mutex_lock (&s->lock);
+	if (!(s->queue = c->next))
+	    s->tail = &s->queue;
+	s->nqueue--;
+	c->next = s->spare;
+	s->spare = c;
+	pthread_cond_broadcast (&s->cond);
+    }
+    pthread_mutex_unlock (&s->lock);
+    return NULL;
+}
+
+static stream_chunk *
+chunk_new (void)
+{
+    stream_chunk    *c = xmalloc (sizeof (stream_chunk));
+
+    c->next = NULL;
+    c->len = 0;
+    c->zdata = NULL;
+    return c;
+}
+
+/* Send the current chunk on its way and start another */
+static void
+stream_handoff (out_stream *s)
+{
+    stream_chunk    *c = s->cur;
+
+    if (!c->len)
+	return;
+    if (!s->threaded) {
+	write_all (s, c->data, c->len);
+	c->len = 0;
+	return;
+    }
+    pthread_mutex_lock (&s->lock);
+    while (s->nqueue >= STREAM_QUEUE)
+	pthread_cond_wait (&s->cond, &s->lock);
+    c->next = NULL;
+    c->claimed = c->done = false;
+    *s->tail = c;
+    s->tail = &c->next;
+    s->nqueue++;
+    if ((c = s->spare))
+	s->spare = c->next;
+    pthread_cond_broadcast (&s->cond);
+    pthread_mutex_unlock (&s->lock);
+    if (!c)
+	c = chunk_new ();
+    c->len = 0;
+    s->cur = c;
+}
+
+/* With GZIP, everything written is compressed, which takes threads */
+static out_stream *
+stream_new (int fd, bool own_fd, char *name, bool gzip)
+{
+    out_stream	*s = xmalloc (sizeof (out_stream));
+    long	n = gzip ? sysconf (_SC_NPROCESSORS_ONLN) : 0;
+
+    memset (s, 0, sizeof (out_stream));
+    s->fd = fd;
+    s->own_fd = own_fd;
+    s->name = strdup (name);
+    s->cur = chunk_new ();
+    s->tail = &s->queue;
+    s->threaded = writer_thread || gzip;
+    if (s->threaded) {
+	pthread_mutex_init (&s->lock, NULL);
+	pthread_cond_init (&s->cond, NULL);
+	if (gzip) {
+	    /* more would only wait on a queue this long */
+	    n = n < 1 ? 1 : n > STREAM_QUEUE ? STREAM_QUEUE : n;
+	    s->gzip = xmalloc (n * sizeof (pthread_t));
+	    while (s->ngzip < n &&
+		   pthread_create (&s->gzip[s->ngzip], NULL,
+				   stream_compressor, s) == 0)
+		s->ngzip++;
+	    if (!s->ngzip) {
+		fprintf (stderr, "parsecvs: no thread to compress %s\n", name);
+		exit (1);
+	    }
+	}
+	if (pthread_create (&s->writer, NULL, stream_writer, s) != 0) {
+	    if (gzip) {
+		fprintf (stderr, "parsecvs: no thread to write %s\n", name);
+		exit (1);
+	    }
+	    s->threaded = false;
+	}
+    }
+    return s;
+}
+
+out_stream *
+stream_fd (int fd, char *name, bool gzip)
+{
+    return stream_new (fd, false, name, gzip);
+}
+
+out_stream *
+stream_open (char *name, bool gzip)
+{
+    int	fd = open (name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+    if (fd < 0) {
+	fprintf (stderr, "parsecvs: %s: %s\n", name, strerror (errno));
+	exit (1);
+    }
+    return stream_new (fd, true, name, gzip);
+}
+
+void
+stream_write (out_stream *s, const void *p, size_t n)
+{
+    stream_chunk    *c = s->cur;
+    size_t	    room;
+
+    if (n <= STREAM_CHUNK - c->len) {
+	memcpy (c->data + c->len, p, n);
+	c->len += n;
+	return;
+    }
+    if (!s->threaded) {
+	stream_handoff (s);
+	write_all (s, p, n);
+	return;
+    }
+    while (n) {
+	c = s->cur;
+	room = STREAM_CHUNK - c->len;
+	if (room > n)
+	    room = n;
+	memcpy (c->data + c->len, p, room);
+	c->len += room;
+	p = (const char *) p + room;
+	n -= room;
+	if (c->len == STREAM_CHUNK)
+	    stream_handoff (s);
+    }
+}
+
+/* Write the LEN bytes in IOV; without a writer thread, big ones go straight out */
+void
+stream_writev (out_stream *s, struct iovec *iov, int iovcnt, size_t len)
+{
+    int	i;
+
+    if (!s->threaded && len > STREAM_CHUNK - s->cur->len) {
+	stream_handoff (s);
+	writev_all (s, iov, iovcnt);
+	return;
+    }
+    for (i = 0; i < iovcnt; i++)
+	stream_write (s, iov[i].iov_base, iov[i].iov_len);
+}
+
+/*
+ * Write the LEN bytes in IOV, which are also the LEN bytes at OFFSET
+ * in the file FD.  Without a writer thread, big ones are sent from the
+ * file by the kernel, and never pass through here at all.
+ */
+void
+stream_sendfile (out_stream *s, int fd, off_t offset,
+		 struct iovec *iov, int iovcnt, size_t len)
+{
+    size_t  sent = 0;
+    ssize_t n;
+
+    if (s->threaded || len <= STREAM_CHUNK - s->cur->len) {
+	stream_writev (s, iov, iovcnt, len);
+	return;
+    }
+    stream_handoff (s);
+    while (sent < len) {
+	n = sendfile (s->fd, fd, &offset, len - sent);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    break;
+	sent += n;
+    }
+    if (sent == len)
+	return;
+    /* the kernel would not, so write the rest from IOV */
+    while (iovcnt && sent >= iov->iov_len) {
+	sent -= iov->iov_len;
+	iov++;
+	iovcnt--;
+    }
+    if (sent) {
+	iov->iov_base = (char *) iov->iov_base + sent;
+	iov->iov_len -= sent;
+    }
+    writev_all (s, iov, iovcnt);
+}
+
+void
+stream_puts (out_stream *s, const char *str)
+{
+    stream_write (s, str, strlen (str));
+}
+
+void
+stream_putc (out_stream *s, int c)
+{
+    if (s->cur->len == STREAM_CHUNK)
+	stream_handoff (s);
+    s->cur->data[s->cur->len++] = c;
+}
+
+void
+stream_uint (out_stream *s, unsigned long v)
+{
+    char    buf[24], *p = buf + sizeof (buf);
+
+    do
+	*--p = '0' + v % 10;
+    while ((v /= 10));
+    stream_write (s, p, buf + sizeof (buf) - p);
+}
+
+void
+stream_octal (out_stream *s, unsigned long v)
+{
+    char    buf[24], *p = buf + sizeof (buf);
+
+    do
+	*--p = '0' + (v & 7);
+    while ((v >>= 3));
+    stream_write (s, p, buf + sizeof (buf) - p);
+}
+
+/* Push out everything written so far */
+void
+stream_flush (out_stream *s)
+{
+    stream_handoff (s);
+    if (s->threaded) {
+	pthread_mutex_lock (&s->lock);
+	while (s->queue)
+	    pthread_cond_wait (&s->cond, &s->lock);
+	pthread_mutex_unlock (&s->lock);
+    }
+}
+
+void
+stream_close (out_stream *s)
+{
+    stream_chunk    *c;
+
+    stream_flush (s);
+    if (s->threaded) {
+	pthread_mutex_lock (&s->lock);
+	s->closing = true;
+	pthread_cond_broadcast (&s->cond);
+	pthread_mutex_unlock (&s->lock);
+	pthread_join (s->writer, NULL);
+	while (s->ngzip)
+	    pthread_join (s->gzip[--s->ngzip], NULL);
+	free (s->gzip);
+	while ((c = s->spare)) {
+	    s->spare = c->next;
+	    free (c->zdata);
+	    free (c);
+	}
+	pthread_mutex_destroy (&s->lock);
+	pthread_cond_destroy (&s->cond);
+    }
+    if (s->own_fd && close (s->fd) < 0)
+	stream_error (s);
+    free (s->cur->zdata);
+    free (s->cur);
+    free (s->name);
+    free (s);
+}
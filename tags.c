@@ -7,6 +7,10 @@ static Tag *table[4096];
 
 Tag *all_tags;
 
+/* the first tag on each tagged commit, hashed by commit */
+static Tag **by_commit;
+static unsigned long by_commit_max;
+
 static int tag_hash(char *name)
 /* return the hash code for a specified tag */ 
 {
@@ -75,11 +79,62 @@ rev_commit **tagged(Tag *tag)
 	return v;
 }
 
+static unsigned long commit_hash(rev_commit *c)
+/* return the slot to look for a commit's tags from */
+{
+	return ((uintptr_t)c >> 4) & (by_commit_max - 1);
+}
+
+void index_tags(void)
+/* file each located tag under its commit, in all_tags order */
+{
+	Tag *tag, **v;
+	unsigned long n = 0, h;
+
+	for (tag = all_tags; tag; tag = tag->next)
+		if (tag->commit)
+			n++;
+	free(by_commit);
+	for (by_commit_max = 16; by_commit_max < 2 * n; by_commit_max *= 2)
+		;
+	by_commit = calloc(by_commit_max, sizeof(Tag *));
+	v = malloc((n + 1) * sizeof(Tag *));
+	for (tag = all_tags, n = 0; tag; tag = tag->next)
+		if (tag->commit)
+			v[n++] = tag;
+	/* backwards, so each chain comes out in list order */
+	while (n--) {
+		tag = v[n];
+		for (h = commit_hash(tag->commit); by_commit[h];
+		     h = (h + 1) & (by_commit_max - 1))
+			if (by_commit[h]->commit == tag->commit)
+				break;
+		tag->commit_next = by_commit[h];
+		by_commit[h] = tag;
+	}
+	free(v);
+}
+
+Tag *commit_tags(rev_commit *c)
+/* return the first tag on a commit; the rest follow by commit_next */
+{
+	unsigned long h;
+
+	if (!by_commit)
+		return NULL;
+	for (h = commit_hash(c); by_commit[h]; h = (h + 1) & (by_commit_max - 1))
+		if (by_commit[h]->commit == c)
+			return by_commit[h];
+	return NULL;
+}
+
 void discard_tags(void)
 /* discard all tag storage */
 {
 	Tag *tag = all_tags;
 	all_tags = NULL;
+	free(by_commit);
+	by_commit = NULL;
 	while (tag) {
 		Tag *p = tag->next;
 		Chunk *c = tag->commits;
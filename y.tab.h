@@ -0,0 +1,148 @@
+/* A Bison parser, made by GNU Bison 3.8.2.  */
+
+/* Bison interface for Yacc-like parsers in C
+
+   Copyright (C) 1984, 1989-1990, 2000-2015, 2018-2021 Free Software Foundation,
+   Inc.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+/* As a special exception, you may create a larger work that contains
+   part or all of the Bison parser skeleton and distribute that work
+   under terms of your choice, so long as that work isn't itself a
+   parser generator using the skeleton or a modified version thereof
+   as a parser skeleton.  Alternatively, if you modify or redistribute
+   the parser skeleton itself, you may (at your option) remove this
+   special exception, which will cause the skeleton and the resulting
+   Bison output files to be licensed under the GNU General Public
+   License without this special exception.
+
+   This special exception was added by the Free Software Foundation in
+   version 2.2 of Bison.  */
+
+/* DO NOT RELY ON FEATURES THAT ARE NOT DOCUMENTED in the manual,
+   especially those whose name start with YY_ or yy_.  They are
+   private implementation details that can be changed or removed.  */
+
+#ifndef YY_YY_Y_TAB_H_INCLUDED
+# define YY_YY_Y_TAB_H_INCLUDED
+/* Debug traces.  */
+#ifndef YYDEBUG
+# define YYDEBUG 0
+#endif
+#if YYDEBUG
+extern int yydebug;
+#endif
+
+/* Token kinds.  */
+#ifndef YYTOKENTYPE
+# define YYTOKENTYPE
+  enum yytokentype
+  {
+    YYEMPTY = -2,
+    YYEOF = 0,                     /* "end of file"  */
+    YYerror = 256,                 /* error  */
+    YYUNDEF = 257,                 /* "invalid token"  */
+    HEAD = 258,                    /* HEAD  */
+    BRANCH = 259,                  /* BRANCH  */
+    ACCESS = 260,                  /* ACCESS  */
+    SYMBOLS = 261,                 /* SYMBOLS  */
+    LOCKS = 262,                   /* LOCKS  */
+    COMMENT = 263,                 /* COMMENT  */
+    DATE = 264,                    /* DATE  */
+    BRANCHES = 265,                /* BRANCHES  */
+    NEXT = 266,                    /* NEXT  */
+    COMMITID = 267,                /* COMMITID  */
+    EXPAND = 268,                  /* EXPAND  */
+    DESC = 269,                    /* DESC  */
+    LOG = 270,                     /* LOG  */
+    TEXT = 271,                    /* TEXT  */
+    STRICT = 272,                  /* STRICT  */
+    AUTHOR = 273,                  /* AUTHOR  */
+    STATE = 274,                   /* STATE  */
+    SEMI = 275,                    /* SEMI  */
+    COLON = 276,                   /* COLON  */
+    BRAINDAMAGED_NUMBER = 277,     /* BRAINDAMAGED_NUMBER  */
+    HEX = 278,                     /* HEX  */
+    NAME = 279,                    /* NAME  */
+    DATA = 280,                    /* DATA  */
+    TEXT_DATA = 281,               /* TEXT_DATA  */
+    NUMBER = 282                   /* NUMBER  */
+  };
+  typedef enum yytokentype yytoken_kind_t;
+#endif
+/* Token kinds.  */
+#define YYEMPTY -2
+#define YYEOF 0
+#define YYerror 256
+#define YYUNDEF 257
+#define HEAD 258
+#define BRANCH 259
+#define ACCESS 260
+#define SYMBOLS 261
+#define LOCKS 262
+#define COMMENT 263
+#define DATE 264
+#define BRANCHES 265
+#define NEXT 266
+#define COMMITID 267
+#define EXPAND 268
+#define DESC 269
+#define LOG 270
+#define TEXT 271
+#define STRICT 272
+#define AUTHOR 273
+#define STATE 274
+#define SEMI 275
+#define COLON 276
+#define BRAINDAMAGED_NUMBER 277
+#define HEX 278
+#define NAME 279
+#define DATA 280
+#define TEXT_DATA 281
+#define NUMBER 282
+
+/* Value type.  */
+#if ! defined YYSTYPE && ! defined YYSTYPE_IS_DECLARED
+union YYSTYPE
+{
+
+    int		i;
+    time_t	date;
+    char	*s;
+    cvs_text	text;
+    cvs_number	number;
+    cvs_symbol	*symbol;
+    cvs_version	*version;
+    cvs_version	**vlist;
+    cvs_patch	*patch;
+    cvs_patch	**patches;
+    cvs_branch	*branch;
+    cvs_file	*file;
+
+
+};
+typedef union YYSTYPE YYSTYPE;
+# define YYSTYPE_IS_TRIVIAL 1
+# define YYSTYPE_IS_DECLARED 1
+#endif
+
+
+extern YYSTYPE yylval;
+
+
+int yyparse (void);
+
+
+#endif /* !YY_YY_Y_TAB_H_INCLUDED  */